@@ -1,18 +1,67 @@
 #include "flecs.h"
 #include "raylib.h"
 #include "raymath.h"
+#include <pthread.h>
+#include <stdatomic.h>
+#include <stddef.h>
 #include <stdint.h>
 #include <stdio.h>
 #include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
 
 typedef Vector2 Velocity;
 typedef Vector2 Position;
 
-typedef float Rotation;
+typedef Vector2 Direction; // Unit vector, {0, -1} is facing up
 typedef float Scale;
 
 typedef uint8_t Team;
 typedef int32_t Health;
+typedef float Lifetime; // Seconds left before despawning
+
+typedef enum Layer {
+    LAYER_PLAYER,
+    LAYER_PLAYER_PROJECTILE,
+    LAYER_ENEMY,
+    LAYER_ENEMY_PROJECTILE,
+    LAYER_PARTICLE,
+
+    LAYER_COUNT,
+} Layer;
+
+typedef struct CollisionMatrix {
+    uint8_t masks[LAYER_COUNT]; // Bit N is set if the layer collides with layer N
+} CollisionMatrix;
+
+void SetLayersCollide(CollisionMatrix *m, Layer a, Layer b, bool collide) {
+    if (collide) {
+        m->masks[a] |= 1 << b;
+        m->masks[b] |= 1 << a;
+    } else {
+        m->masks[a] &= ~(1 << b);
+        m->masks[b] &= ~(1 << a);
+    }
+}
+
+bool LayersCollide(CollisionMatrix m, Layer a, Layer b) {
+    return m.masks[a] & (1 << b);
+}
+
+CollisionMatrix DefaultCollisionMatrix(void) {
+    CollisionMatrix m = {0};
+
+    SetLayersCollide(&m, LAYER_PLAYER, LAYER_ENEMY, true);
+    SetLayersCollide(&m, LAYER_PLAYER, LAYER_ENEMY_PROJECTILE, true);
+
+    SetLayersCollide(&m, LAYER_PLAYER_PROJECTILE, LAYER_ENEMY, true);
+    SetLayersCollide(&m, LAYER_PLAYER_PROJECTILE, LAYER_ENEMY_PROJECTILE, true);
+
+    SetLayersCollide(&m, LAYER_ENEMY, LAYER_ENEMY, true); // Pushing each other apart
+
+    return m;
+}
 
 typedef struct HitBox {
     int32_t damage;
@@ -49,29 +98,54 @@ HitBox LineHitBox(int32_t damage, float length) {
     };
 }
 
-Vector2 Vector2MoveRotation(Vector2 pos, float dist, float rot) {
-    return Vector2Add(pos, Vector2Rotate((Vector2){.x = 0, .y = -dist}, rot));
+#define DIRECTION_UP ((Direction){0, -1})
+
+Vector2 Vector2MoveDirection(Vector2 pos, float dist, Direction dir) {
+    return Vector2Add(pos, Vector2Scale(dir, dist));
+}
+
+// Rotates v by the same angle that turns DIRECTION_UP into dir
+Vector2 Vector2RotateDirection(Vector2 v, Direction dir) {
+    return (Vector2){
+        -v.x * dir.y - v.y * dir.x,
+        v.x * dir.x - v.y * dir.y,
+    };
+}
+
+// Clockwise angle from DIRECTION_UP, only needed for drawing
+float DirectionAngle(Direction dir) {
+    return atan2f(dir.x, -dir.y);
 }
 
-float Vector2AngleTo(Vector2 pos_a, Vector2 pos_b) {
-    return Vector2LineAngle(pos_a, pos_b) - PI/2;
+// Normalized lerp, turns a direction towards another one
+Direction NlerpDirection(Direction from, Direction to, float w) {
+    // Lerping between opposite directions never leaves their axis, turn to a side first
+    if (Vector2DotProduct(from, to) < -0.9999f) {
+        to = (Direction){-from.y, from.x};
+    }
+
+    Vector2 d = Vector2Lerp(from, to, w);
+    float len = Vector2Length(d);
+
+    if (len < 1e-6f) return from;
+    return Vector2Scale(d, 1 / len);
 }
 
-Vector2 GetLineBegin(Position pos, Rotation rot, HitBox hb) {
+Vector2 GetLineBegin(Position pos, Direction dir, HitBox hb) {
     assert(hb.type == LINE);
 
-    return Vector2MoveRotation(pos, -hb.data.line_data.length, rot);
+    return Vector2MoveDirection(pos, -hb.data.line_data.length, dir);
 }
 
-Vector2 GetLineEnd(Position pos, Rotation rot, HitBox hb) {
+Vector2 GetLineEnd(Position pos, Direction dir, HitBox hb) {
     assert(hb.type == LINE);
 
-    return Vector2MoveRotation(pos, hb.data.line_data.length, rot);
+    return Vector2MoveDirection(pos, hb.data.line_data.length, dir);
 }
 
 bool CheckHit(
-        Position a_pos, Rotation a_rot, HitBox a,
-        Position b_pos, Rotation b_rot, HitBox b) {
+        Position a_pos, Direction a_rot, HitBox a,
+        Position b_pos, Direction b_rot, HitBox b) {
     // quite ugly.......
     switch (a.type) {
         case LINE: {
@@ -147,6 +221,55 @@ typedef struct AIInfo {
     float max_turning_speed;
 } AIInfo;
 
+// Level of detail tiers, by distance to the player
+typedef struct AILod {
+    float near_distance; // Closer than this re-steers every tick, budget permitting
+    float far_distance; // Further than this flies straight at the player
+
+    int32_t mid_period; // Ticks between re-steering in between the two
+    int32_t far_period; // Ticks between aiming far away enemies at the player again
+
+    // Near and mid range steering updates per tick, the periods stretch to stay under it
+    int32_t steer_budget;
+} AILod;
+
+typedef struct AIParams {
+    AILod lod;
+
+    Position player_pos;
+    uint32_t tick;
+    int32_t near_period; // For this tick
+    int32_t mid_period;
+    int32_t slowdown; // Stretches the mid period further, set by the quality governor
+
+    // Enemies seen this tick
+    atomic_int near_count;
+    atomic_int mid_count;
+} AIParams;
+
+// Ticks between updates so count updates fit in budget, never below min_period
+int32_t BudgetPeriod(int32_t count, int32_t budget, int32_t min_period) {
+    if (budget < 1) budget = 1;
+    int32_t needed = (count + budget - 1) / budget;
+    return needed > min_period ? needed : min_period;
+}
+
+// Call once per tick before running the AI system
+void PrepareAI(AIParams *params, Position player_pos) {
+    int32_t near_count = atomic_exchange(&params->near_count, 0);
+    int32_t mid_count = atomic_exchange(&params->mid_count, 0);
+
+    // Near enemies get the budget first, mid range ones share what's left
+    params->near_period = BudgetPeriod(near_count, params->lod.steer_budget, 1);
+    int32_t left = params->lod.steer_budget - near_count / params->near_period;
+
+    params->mid_period = BudgetPeriod(mid_count, left, params->lod.mid_period);
+    if (params->slowdown > 1) params->mid_period *= params->slowdown;
+
+    params->player_pos = player_pos;
+    params->tick++;
+}
+
 #define COMPONENTS(ecs) \
     ECS_COMPONENT(ecs, Animation); \
     \
@@ -156,14 +279,16 @@ typedef struct AIInfo {
     \
     ECS_COMPONENT(ecs, Position); \
     ECS_COMPONENT(ecs, Velocity); \
-    ECS_COMPONENT(ecs, Rotation); \
+    ECS_COMPONENT(ecs, Direction); \
     ECS_COMPONENT(ecs, Scale); \
     \
     ECS_COMPONENT(ecs, Health); \
+    ECS_COMPONENT(ecs, Lifetime); \
     \
     ECS_COMPONENT(ecs, HitBox); \
     \
     ECS_COMPONENT(ecs, Team); \
+    ECS_COMPONENT(ecs, Layer); \
     \
     ECS_COMPONENT(ecs, Flags) 
 
@@ -177,23 +302,17 @@ Rectangle RecV(Vector2 pos, Vector2 size) {
     return (Rectangle){pos.x, pos.y, size.x, size.y};
 }
 
-Rectangle RecEx(Vector2 pos, Vector2 size, Rotation r, Scale s) {
+Rectangle RecEx(Vector2 pos, Vector2 size, Direction d, Scale s) {
     Vector2 ss = Vector2Scale(size, s);
     Vector2 halfss = Vector2Scale(ss, 0.5);
 
-    Vector2 p = Vector2Subtract(pos, Vector2Rotate(halfss, r));
+    Vector2 p = Vector2Subtract(pos, Vector2RotateDirection(halfss, d));
 
     return RecV(p, ss);
 }
 
 float ToDeg(float rad) { return (180 / PI) * rad; }
 float ToRad(float deg) { return (PI / 180) * deg; }
-float LerpRad(float A, float B, float w) {
-    float CS = (1-w)*cos(A) + w*cos(B);
-    float SN = (1-w)*sin(A) + w*sin(B);
-    float C = atan2(SN,CS);
-    return C;
-}
 
 typedef struct Button {
     const char* text;
@@ -228,7 +347,8 @@ bool IsMouseHoveringButton(Button b) {
     return CheckCollisionPointRec(GetMousePosition(), rec);
 }
 
-bool ShowButton(Button b) {
+// clicked: whether the left mouse button was pressed this frame
+bool ShowButton(Button b, bool clicked) {
     Vector2 size = MeasureButton(b);
     Vector2 halfsize = Vector2Scale(size, 0.5);
     
@@ -251,74 +371,672 @@ bool ShowButton(Button b) {
         DrawRectangleLinesEx(rec, 5, color);
     }
 
-    return IsMouseButtonPressed(MOUSE_BUTTON_LEFT) && IsMouseHoveringButton(b);
+    return clicked && IsMouseHoveringButton(b);
 }
 
 void Move(ecs_iter_t *it) {
     Position *p = ecs_field(it, Position, 1);
     Velocity *v = ecs_field(it, Velocity, 2);
-    Rotation *r = ecs_field(it, Rotation, 3);
+    Direction *d = ecs_field(it, Direction, 3);
 
     for (int i = 0; i < it->count; i++) {
         p[i].x += v[i].x * it->delta_time;
         p[i].y += v[i].y * it->delta_time;
 
-        Rotation target = -Vector2Angle((Vector2){0, -1}, v[i]);
-        r[i] = target;
+        // Face where we're going, keep the last direction when standing still
+        float speed = Vector2Length(v[i]);
+        if (speed > 0) {
+            d[i] = Vector2Scale(v[i], 1 / speed);
+        }
     }
 }
 
-void Collisions(ecs_iter_t *it) {
-    const Flags *f = ecs_field(it, Flags, 1);
+#define MAX_WORKERS 64
+#define CHUNKS_PER_WORKER 8
+#define MIN_CHUNK_SIZE 256 // Entities or rows, smaller chunks cost more to hand out than to run
+
+typedef void (*ChunkFn)(void *ctx, int32_t chunk, int32_t worker);
+
+// Chunks a worker owns, other workers steal from the same cursor once they run dry
+typedef struct WorkRange {
+    _Alignas(64) atomic_int next;
+    int32_t end;
+} WorkRange;
+
+// Worker pool that runs parallel-for jobs, the calling thread acts as worker 0
+typedef struct Scheduler {
+    int32_t worker_count;
+    pthread_t threads[MAX_WORKERS];
+
+    pthread_mutex_t lock;
+    pthread_cond_t wake;
+    pthread_cond_t done;
+    uint64_t generation; // Bumped for every job
+    int32_t busy; // Spawned workers that haven't finished the current job
+    bool quit;
+
+    ChunkFn fn;
+    void *ctx;
+    WorkRange ranges[MAX_WORKERS];
+} Scheduler;
+
+typedef struct WorkerArgs {
+    Scheduler *s;
+    int32_t worker;
+} WorkerArgs;
+
+void RunChunks(Scheduler *s, int32_t worker) {
+    // Own chunks first, then steal from everyone else
+    for (int v = 0; v < s->worker_count; v++) {
+        WorkRange *range = &s->ranges[(worker + v) % s->worker_count];
+
+        int32_t chunk;
+        while ((chunk = atomic_fetch_add(&range->next, 1)) < range->end) {
+            s->fn(s->ctx, chunk, worker);
+        }
+    }
+}
 
-    Position *p = ecs_field(it, Position, 2);
-    Velocity *v = ecs_field(it, Velocity, 3);
-    const Rotation *r = ecs_field(it, Rotation, 4);
+void *SchedulerWorker(void *arg) {
+    WorkerArgs args = *(WorkerArgs*)arg;
+    free(arg);
 
-    const HitBox *hb = ecs_field(it, HitBox, 5);
-    const Team *t = ecs_field(it, Team, 6);
+    Scheduler *s = args.s;
+    uint64_t seen = 0;
 
-    Health *h = ecs_field(it, Health, 7);
-    IFrames *im = ecs_field(it, IFrames, 8);
+    pthread_mutex_lock(&s->lock);
+    while (true) {
+        while (!s->quit && s->generation == seen) {
+            pthread_cond_wait(&s->wake, &s->lock);
+        }
+        if (s->quit) break;
+        seen = s->generation;
 
-    for (int i = 0; i < it->count; i++) {
-        for (int j = i + 1; j < it->count; j++) {
-            if (!CheckHit(p[i], r[i], hb[i], p[j], r[j], hb[j])) continue;
-
-            if (im[i].cur <= 0 && im[j].cur <= 0 && t[i] != t[j]) {
-                // Decrement health
-                h[i] -= hb[j].damage;
-                h[j] -= hb[i].damage;
-
-                // Add iframes
-                im[i].cur += im[i].init;
-                im[j].cur += im[j].init;
-            } 
-           
-            if (hb[i].type != CIRCLE || hb[j].type != CIRCLE) continue; 
-            
-            if (f[i] & PUSH_ON_COLLISION) {
-                p[i] = Vector2MoveRotation(p[i], 90 * it->delta_time, Vector2AngleTo(p[i], p[j]));
+        pthread_mutex_unlock(&s->lock);
+        RunChunks(s, args.worker);
+        pthread_mutex_lock(&s->lock);
+
+        if (--s->busy == 0) {
+            pthread_cond_signal(&s->done);
+        }
+    }
+    pthread_mutex_unlock(&s->lock);
+
+    return NULL;
+}
+
+void StartScheduler(Scheduler *s, int32_t worker_count) {
+    *s = (Scheduler){0};
+    pthread_mutex_init(&s->lock, NULL);
+    pthread_cond_init(&s->wake, NULL);
+    pthread_cond_init(&s->done, NULL);
+
+    s->worker_count = 1;
+    for (int w = 1; w < worker_count && w < MAX_WORKERS; w++) {
+        WorkerArgs *args = malloc(sizeof(WorkerArgs));
+        *args = (WorkerArgs){s, w};
+
+        if (pthread_create(&s->threads[w], NULL, SchedulerWorker, args) != 0) {
+            free(args);
+            break;
+        }
+        s->worker_count++;
+    }
+}
+
+void StopScheduler(Scheduler *s) {
+    pthread_mutex_lock(&s->lock);
+    s->quit = true;
+    pthread_cond_broadcast(&s->wake);
+    pthread_mutex_unlock(&s->lock);
+
+    for (int w = 1; w < s->worker_count; w++) {
+        pthread_join(s->threads[w], NULL);
+    }
+
+    pthread_cond_destroy(&s->done);
+    pthread_cond_destroy(&s->wake);
+    pthread_mutex_destroy(&s->lock);
+}
+
+// Calls fn for every chunk in [0, chunk_count) and waits for all of them to finish
+void ParallelFor(Scheduler *s, int32_t chunk_count, ChunkFn fn, void *ctx) {
+    if (!s || s->worker_count <= 1 || chunk_count <= 1) {
+        for (int c = 0; c < chunk_count; c++) {
+            fn(ctx, c, 0);
+        }
+        return;
+    }
+
+    for (int w = 0; w < s->worker_count; w++) {
+        atomic_store(&s->ranges[w].next, (int64_t)chunk_count * w / s->worker_count);
+        s->ranges[w].end = (int64_t)chunk_count * (w + 1) / s->worker_count;
+    }
+
+    pthread_mutex_lock(&s->lock);
+    s->fn = fn;
+    s->ctx = ctx;
+    s->busy = s->worker_count - 1;
+    s->generation++;
+    pthread_cond_broadcast(&s->wake);
+    pthread_mutex_unlock(&s->lock);
+
+    RunChunks(s, 0);
+
+    pthread_mutex_lock(&s->lock);
+    while (s->busy > 0) {
+        pthread_cond_wait(&s->done, &s->lock);
+    }
+    pthread_mutex_unlock(&s->lock);
+}
+
+// Enough chunks to balance the work, but none so small that scheduling dominates
+int32_t ChunkCountFor(const Scheduler *s, int32_t work) {
+    int32_t max = s->worker_count * CHUNKS_PER_WORKER;
+    int32_t n = work / MIN_CHUNK_SIZE;
+    return n < 1 ? 1 : n > max ? max : n;
+}
+
+typedef struct SystemJob {
+    ecs_world_t *ecs;
+    ecs_entity_t system;
+    int32_t chunk_count;
+    float dt;
+    void *param;
+} SystemJob;
+
+void RunSystemChunk(void *ctx, int32_t chunk, int32_t worker) {
+    SystemJob *job = ctx;
+    ecs_run_worker(ecs_get_stage(job->ecs, worker), job->system, chunk, job->chunk_count, job->dt, job->param);
+}
+
+// Runs a multi threaded system split into chunks sized by its entity count,
+// commands are merged afterwards. Small systems just run on the calling thread
+void RunParallel(Scheduler *s, ecs_world_t *ecs, ecs_entity_t system, float dt, void *param) {
+    int32_t chunk_count = 1;
+    if (s && s->worker_count > 1) {
+        chunk_count = ChunkCountFor(s, ecs_query_entity_count(ecs_system_get_query(ecs, system)));
+    }
+
+    if (chunk_count <= 1) {
+        ecs_run(ecs, system, dt, param);
+        return;
+    }
+
+    SystemJob job = {
+        .ecs = ecs,
+        .system = system,
+        .chunk_count = chunk_count,
+        .dt = dt,
+        .param = param,
+    };
+
+    ecs_readonly_begin(ecs);
+    ParallelFor(s, job.chunk_count, RunSystemChunk, &job);
+    ecs_readonly_end(ecs);
+}
+
+// Counters for the allocations flecs makes through its OS API and the frame arenas make on the heap
+typedef struct AllocStats {
+    int64_t count;
+    int64_t frees;
+    int64_t bytes;
+} AllocStats;
+
+static bool alloc_tracking = false; // Only counted once the hooks are installed
+static _Atomic int64_t alloc_count = 0;
+static _Atomic int64_t free_count = 0;
+static _Atomic int64_t alloc_bytes = 0;
+
+void CountAlloc(size_t size) {
+    if (!alloc_tracking) return;
+    atomic_fetch_add_explicit(&alloc_count, 1, memory_order_relaxed);
+    atomic_fetch_add_explicit(&alloc_bytes, size, memory_order_relaxed);
+}
+
+void CountFree(void) {
+    if (!alloc_tracking) return;
+    atomic_fetch_add_explicit(&free_count, 1, memory_order_relaxed);
+}
+
+// Bump allocator for data that only lives for a single frame
+typedef struct ArenaBlock {
+    struct ArenaBlock *next;
+    max_align_t data[];
+} ArenaBlock;
+
+typedef struct FrameArena {
+    uint8_t *data;
+    size_t capacity;
+    size_t used;
+
+    size_t requested; // Total requested this frame, the arena grows to it on reset
+    size_t peak;
+
+    void *last; // Most recent allocation, the only one that can grow in place
+    ArenaBlock *overflow; // Heap blocks for when the arena runs out mid-frame
+} FrameArena;
+
+#define ARENA_ALIGN sizeof(max_align_t)
+
+// Heap memory of an arena, counted like the allocations flecs makes
+void *ArenaHeapAlloc(size_t size) {
+    void *ptr = malloc(size);
+    if (ptr) CountAlloc(size);
+    return ptr;
+}
+
+void ArenaHeapFree(void *ptr) {
+    if (ptr) CountFree();
+    free(ptr);
+}
+
+void *ArenaAlloc(FrameArena *a, size_t size) {
+    size = (size + ARENA_ALIGN - 1) & ~(ARENA_ALIGN - 1);
+    a->requested += size;
+
+    if (a->used + size > a->capacity) {
+        ArenaBlock *block = ArenaHeapAlloc(sizeof(ArenaBlock) + size);
+        if (!block) { // Callers can't go on without the memory, the frame would be corrupt
+            fprintf(stderr, "Frame arena: out of memory allocating %zu bytes\n", size);
+            abort();
+        }
+
+        block->next = a->overflow;
+        a->overflow = block;
+
+        a->last = NULL;
+        return block->data;
+    }
+
+    a->last = a->data + a->used;
+    a->used += size;
+    return a->last;
+}
+
+// Like realloc, grows in place when ptr is the latest allocation
+void *ArenaGrow(FrameArena *a, void *ptr, size_t old_size, size_t new_size) {
+    old_size = (old_size + ARENA_ALIGN - 1) & ~(ARENA_ALIGN - 1);
+    new_size = (new_size + ARENA_ALIGN - 1) & ~(ARENA_ALIGN - 1);
+
+    if (ptr && ptr == a->last && (uint8_t*)ptr + new_size <= a->data + a->capacity) {
+        a->used += new_size - old_size;
+        a->requested += new_size - old_size;
+        return ptr;
+    }
+
+    void *grown = ArenaAlloc(a, new_size);
+    if (ptr) memcpy(grown, ptr, old_size);
+    return grown;
+}
+
+void ResetArena(FrameArena *a) {
+    while (a->overflow) {
+        ArenaBlock *next = a->overflow->next;
+        ArenaHeapFree(a->overflow);
+        a->overflow = next;
+    }
+
+    if (a->requested > a->peak) a->peak = a->requested;
+
+    if (a->requested > a->capacity) { // Grow so the next frame fits without overflowing
+        uint8_t *data = ArenaHeapAlloc(a->requested * 2);
+        if (data) { // Otherwise keep the old buffer and overflow again
+            ArenaHeapFree(a->data);
+            a->data = data;
+            a->capacity = a->requested * 2;
+        }
+    }
+
+    a->used = 0;
+    a->requested = 0;
+    a->last = NULL;
+}
+
+void FreeArena(FrameArena *a) {
+    ResetArena(a);
+    ArenaHeapFree(a->data);
+    *a = (FrameArena){0};
+}
+
+typedef struct Collider {
+    Position *p;
+    Direction d;
+    HitBox hb;
+    Team t;
+    Layer l;
+    Flags f;
+
+    Health *h;
+    IFrames *im;
+
+    // Bounding box used by the broadphase
+    float min_x, max_x;
+    float min_y, max_y;
+} Collider;
+
+typedef struct CollisionHit {
+    int32_t a, b; // Collider indices
+} CollisionHit;
+
+// Hits found by one chunk of rows, concatenated in chunk order afterwards
+typedef struct CollisionChunk {
+    CollisionHit *hits;
+    int32_t count;
+    int32_t capacity;
+} CollisionChunk;
+
+// Responses accumulated for a collider before they are written back
+typedef struct CollisionDelta {
+    int32_t damage;
+    int32_t iframes;
+    Vector2 push;
+} CollisionDelta;
+
+typedef struct LayerPair {
+    Layer a, b;
+    int32_t row_start; // First row of this pair, one row per collider in layer a
+} LayerPair;
+
+typedef struct CollisionLayers {
+    CollisionMatrix matrix;
+
+    FrameArena *arena;
+
+    Scheduler *scheduler;
+    FrameArena worker_arenas[MAX_WORKERS]; // Scratch for hit lists, reset every run
+
+    // Colliders grouped by layer, each group sorted by min_x every frame
+    Collider *colliders;
+    int32_t start[LAYER_COUNT + 1];
+    float max_width[LAYER_COUNT]; // Widest bounding box of each layer
+
+    // Work for the parallel pair search
+    LayerPair pairs[LAYER_COUNT * LAYER_COUNT];
+    int32_t pair_count;
+    int32_t row_count;
+
+    CollisionChunk *chunks;
+    int32_t chunk_count;
+
+    float dt;
+} CollisionLayers;
+
+float HitBoxExtent(HitBox hb) {
+    switch (hb.type) {
+        case LINE: return hb.data.line_data.length;
+        case CIRCLE: return hb.data.circle_data.radius;
+    }
+    return 0;
+}
+
+int CompareColliders(const void *a, const void *b) {
+    float ax = ((const Collider*)a)->min_x;
+    float bx = ((const Collider*)b)->min_x;
+    return (ax > bx) - (ax < bx);
+}
+
+bool DealsDamage(const Collider *a, const Collider *b) {
+    return a->t != b->t;
+}
+
+bool Pushes(const Collider *a, const Collider *b) {
+    return a->hb.type == CIRCLE && b->hb.type == CIRCLE && ((a->f | b->f) & PUSH_ON_COLLISION);
+}
+
+// Only reads component data, so it's safe to call from any worker
+bool TestCollision(const Collider *a, const Collider *b) {
+    // Same team and nothing to push, don't bother with the geometry
+    if (!DealsDamage(a, b) && !Pushes(a, b)) return false;
+
+    return CheckHit(*a->p, a->d, a->hb, *b->p, b->d, b->hb);
+}
+
+void PushHit(CollisionChunk *chunk, FrameArena *arena, int32_t a, int32_t b) {
+    if (chunk->count == chunk->capacity) {
+        int32_t grown = chunk->capacity ? chunk->capacity * 2 : 16;
+        chunk->hits = ArenaGrow(arena, chunk->hits, chunk->capacity * sizeof(CollisionHit), grown * sizeof(CollisionHit));
+        chunk->capacity = grown;
+    }
+
+    chunk->hits[chunk->count++] = (CollisionHit){a, b};
+}
+
+// First collider with min_x >= x, colliders are sorted by min_x
+int32_t LowerBoundMinX(const Collider *c, int32_t count, float x) {
+    int32_t lo = 0, hi = count;
+    while (lo < hi) {
+        int32_t mid = lo + (hi - lo) / 2;
+        if (c[mid].min_x < x) lo = mid + 1;
+        else hi = mid;
+    }
+    return lo;
+}
+
+// Tests the pairs of a chunk of rows against overlapping bounding boxes of the other layer
+void FindCollisions(void *ctx, int32_t chunk, int32_t worker) {
+    CollisionLayers *cl = ctx;
+    FrameArena *arena = &cl->worker_arenas[worker];
+    CollisionChunk *out = &cl->chunks[chunk];
+
+    int32_t row_begin = (int64_t)cl->row_count * chunk / cl->chunk_count;
+    int32_t row_end = (int64_t)cl->row_count * (chunk + 1) / cl->chunk_count;
+
+    for (int pi = 0; pi < cl->pair_count; pi++) {
+        LayerPair pair = cl->pairs[pi];
+
+        int32_t a_start = cl->start[pair.a];
+        int32_t b_start = cl->start[pair.b];
+        int32_t a_count = cl->start[pair.a + 1] - a_start;
+        int32_t b_count = cl->start[pair.b + 1] - b_start;
+
+        int32_t begin = row_begin - pair.row_start;
+        int32_t end = row_end - pair.row_start;
+        if (begin < 0) begin = 0;
+        if (end > a_count) end = a_count;
+
+        Collider *a = cl->colliders + a_start;
+        Collider *b = cl->colliders + b_start;
+
+        // Nothing in b starting further left than this can reach a[i], rows are
+        // sorted by min_x so the first candidate only ever moves right
+        float reach = cl->max_width[pair.b];
+        int32_t first = begin < end ? LowerBoundMinX(b, b_count, a[begin].min_x - reach) : 0;
+
+        for (int i = begin; i < end; i++) {
+            while (first < b_count && b[first].min_x < a[i].min_x - reach) first++;
+
+            // Within a single layer only look forward, so each pair is tested once
+            for (int j = pair.a == pair.b ? i + 1 : first; j < b_count; j++) {
+                if (b[j].min_x > a[i].max_x) break; // Sorted, nothing further can overlap
+                if (b[j].max_x < a[i].min_x) continue;
+                if (b[j].max_y < a[i].min_y || b[j].min_y > a[i].max_y) continue;
+
+                if (TestCollision(&a[i], &b[j])) {
+                    PushHit(out, arena, a_start + i, b_start + j);
+                }
             }
+        }
+    }
+}
+
+void ResolveCollision(CollisionDelta *da, CollisionDelta *db, const Collider *a, const Collider *b, float dt) {
+    // Iframes picked up earlier this frame count as well
+    bool immune = a->im->cur + da->iframes > 0 || b->im->cur + db->iframes > 0;
+
+    if (DealsDamage(a, b) && !immune) {
+        // Decrement health
+        da->damage += b->hb.damage;
+        db->damage += a->hb.damage;
+
+        // Add iframes
+        da->iframes += a->im->init;
+        db->iframes += b->im->init;
+    }
+
+    if (!Pushes(a, b)) return;
+
+    // Apart from each other
+    Direction away = Vector2Normalize(Vector2Subtract(*a->p, *b->p));
 
-            if (f[j] & PUSH_ON_COLLISION) {
-                p[j] = Vector2MoveRotation(p[j], 90 * it->delta_time, Vector2AngleTo(p[j], p[i]));
+    if (a->f & PUSH_ON_COLLISION) {
+        da->push = Vector2MoveDirection(da->push, 90 * dt, away);
+    }
+
+    if (b->f & PUSH_ON_COLLISION) {
+        db->push = Vector2MoveDirection(db->push, -90 * dt, away);
+    }
+}
+
+void Collisions(ecs_iter_t *it) {
+    CollisionLayers *cl = it->ctx;
+
+    Collider *gathered = NULL;
+    int32_t count = 0, capacity = 0;
+    int32_t layer_count[LAYER_COUNT] = {0};
+    float max_width[LAYER_COUNT] = {0};
+
+    // Gather colliders of every table
+    while (ecs_iter_next(it)) {
+        const Flags *f = ecs_field(it, Flags, 1);
+
+        Position *p = ecs_field(it, Position, 2);
+        const Direction *d = ecs_field(it, Direction, 4);
+
+        const HitBox *hb = ecs_field(it, HitBox, 5);
+        const Team *t = ecs_field(it, Team, 6);
+        const Layer *l = ecs_field(it, Layer, 7);
+
+        Health *h = ecs_field(it, Health, 8);
+        IFrames *im = ecs_field(it, IFrames, 9);
+
+        for (int i = 0; i < it->count; i++) {
+            if (!cl->matrix.masks[l[i]]) continue; // Collides with nothing
+
+            float extent = HitBoxExtent(hb[i]);
+
+            if (count == capacity) {
+                int32_t grown = capacity ? capacity * 2 : 64;
+                gathered = ArenaGrow(cl->arena, gathered, capacity * sizeof(Collider), grown * sizeof(Collider));
+                capacity = grown;
             }
+
+            layer_count[l[i]]++;
+            gathered[count] = (Collider){
+                .p = &p[i],
+                .d = d[i],
+                .hb = hb[i],
+                .t = t[i],
+                .l = l[i],
+                .f = f[i],
+
+                .h = &h[i],
+                .im = &im[i],
+
+                .min_x = p[i].x - extent,
+                .max_x = p[i].x + extent,
+                .min_y = p[i].y - extent,
+                .max_y = p[i].y + extent,
+            };
+
+            float width = gathered[count].max_x - gathered[count].min_x;
+            if (width > max_width[l[i]]) max_width[l[i]] = width;
+            count++;
+        }
+    }
+
+    memcpy(cl->max_width, max_width, sizeof(max_width));
+
+    // Bucket by layer
+    cl->start[0] = 0;
+    for (int l = 0; l < LAYER_COUNT; l++) {
+        cl->start[l + 1] = cl->start[l] + layer_count[l];
+        layer_count[l] = cl->start[l]; // Reused as the insertion cursor
+    }
+
+    cl->colliders = ArenaAlloc(cl->arena, count * sizeof(Collider));
+    for (int i = 0; i < count; i++) {
+        cl->colliders[layer_count[gathered[i].l]++] = gathered[i];
+    }
+
+    for (int l = 0; l < LAYER_COUNT; l++) {
+        int32_t n = cl->start[l + 1] - cl->start[l];
+        if (n < 2) continue;
+        qsort(cl->colliders + cl->start[l], n, sizeof(Collider), CompareColliders);
+    }
+
+    // Only pairs of layers that interact are ever tested
+    cl->pair_count = 0;
+    cl->row_count = 0;
+    for (int la = 0; la < LAYER_COUNT; la++) {
+        for (int lb = la; lb < LAYER_COUNT; lb++) {
+            if (!LayersCollide(cl->matrix, la, lb)) continue;
+
+            cl->pairs[cl->pair_count++] = (LayerPair){la, lb, cl->row_count};
+            cl->row_count += cl->start[la + 1] - cl->start[la];
+        }
+    }
+
+    // Find hits in parallel, every chunk writes to its own list
+    int32_t workers = cl->scheduler ? cl->scheduler->worker_count : 1;
+    for (int w = 0; w < workers; w++) {
+        ResetArena(&cl->worker_arenas[w]);
+    }
+
+    cl->chunk_count = cl->scheduler ? ChunkCountFor(cl->scheduler, cl->row_count) : 1;
+    cl->chunks = ArenaAlloc(cl->arena, cl->chunk_count * sizeof(CollisionChunk));
+    memset(cl->chunks, 0, cl->chunk_count * sizeof(CollisionChunk));
+    cl->dt = it->delta_time;
+
+    ParallelFor(cl->scheduler, cl->chunk_count, FindCollisions, cl);
+
+    // Chunks are in row order, so reducing them in order is deterministic
+    CollisionDelta *deltas = ArenaAlloc(cl->arena, count * sizeof(CollisionDelta));
+    memset(deltas, 0, count * sizeof(CollisionDelta));
+
+    for (int c = 0; c < cl->chunk_count; c++) {
+        for (int i = 0; i < cl->chunks[c].count; i++) {
+            CollisionHit hit = cl->chunks[c].hits[i];
+            ResolveCollision(
+                    &deltas[hit.a], &deltas[hit.b],
+                    &cl->colliders[hit.a], &cl->colliders[hit.b], cl->dt);
         }
     }
+
+    for (int i = 0; i < count; i++) {
+        Collider *c = &cl->colliders[i];
+
+        *c->h -= deltas[i].damage;
+        c->im->cur += deltas[i].iframes;
+        *c->p = Vector2Add(*c->p, deltas[i].push);
+    }
 }
 
+typedef struct HealthParams {
+    const Animation *explosion;
+    int32_t explosion_cap; // Explosions spawned per tick, negative for no limit
+    int32_t explosions; // Spawned this tick
+    int32_t kills; // Enemies that ran out of health
+} HealthParams;
+
 void HealthCheck(ecs_iter_t *it) {
     COMPONENTS(it->world);
 
     Health *h = ecs_field(it, Health, 1);
     Flags *f = ecs_field(it, Flags, 2);
+    Layer *l = ecs_field(it, Layer, 3);
 
-    Animation* a_explosion = (Animation*)it->param;
+    HealthParams *params = it->param;
+    const Animation *a_explosion = params->explosion;
 
     for (int i = 0; i < it->count; i++) {
         if (h[i] > 0) continue;
-        if (f[i] & EXPLODE_ON_DEATH) {
+        if (l[i] == LAYER_ENEMY) params->kills++;
+
+        bool capped = params->explosion_cap >= 0 && params->explosions >= params->explosion_cap;
+        if ((f[i] & EXPLODE_ON_DEATH) && !capped) {
+            params->explosions++;
+
             ecs_entity_t explosion = ecs_new_id(it->world);
             
             const Position* pos = ecs_get(it->world, it->entities[i], Position);
@@ -326,12 +1044,13 @@ void HealthCheck(ecs_iter_t *it) {
             if (pos) {
                 ecs_set_ptr(it->world, explosion, Position, pos);
 
-                ecs_set(it->world, explosion, Rotation, {0});
+                ecs_set(it->world, explosion, Direction, {0, -1});
                 ecs_set(it->world, explosion, Scale, {5});
 
                 ecs_set_ptr(it->world, explosion, Animation, a_explosion);
 
                 ecs_set(it->world, explosion, Flags, {PARTICLE});
+                ecs_set(it->world, explosion, Layer, {LAYER_PARTICLE});
             }
         } 
         ecs_delete(it->world, it->entities[i]);
@@ -360,16 +1079,48 @@ void DecrementIFrames(ecs_iter_t *it) {
     }
 }
 
+typedef struct CullParams {
+    Position center; // The player
+    float max_distance;
+} CullParams;
+
+// Despawns entities that outlived their lifetime or strayed too far from the player
+void CullExpired(ecs_iter_t *it) {
+    Position *p = ecs_field(it, Position, 1);
+    Lifetime *lt = ecs_field(it, Lifetime, 2);
+
+    CullParams *params = it->param;
+    float max_distance_sqr = params->max_distance * params->max_distance;
+
+    for (int i = 0; i < it->count; i++) {
+        lt[i] -= it->delta_time;
+        if (lt[i] <= 0 || Vector2DistanceSqr(p[i], params->center) > max_distance_sqr) {
+            ecs_delete(it->world, it->entities[i]);
+        }
+    }
+}
+
+void SteerHoming(Position p, Direction *d, Velocity *v, AIInfo ai, Position target, float dt) {
+    Direction to_target = Vector2Normalize(Vector2Subtract(target, p));
+    *d = NlerpDirection(*d, to_target, fminf(dt*ai.max_turning_speed, 1));
+
+    *v = Vector2Scale(*d, ai.max_velocity);
+}
+
 void SimulateAI(ecs_iter_t *it) {
-    Flags *f = ecs_field(it, Flags, 1);
-    
     Position *p = ecs_field(it, Position, 2);
-    Rotation *r = ecs_field(it, Rotation, 3);
+    Direction *d = ecs_field(it, Direction, 3);
     Velocity *v = ecs_field(it, Velocity, 4);
 
     AIInfo *ai = ecs_field(it, AIInfo, 5);
 
-    Position player_pos = *(Position*)it->param;
+    AIParams *params = it->param;
+    Position player_pos = params->player_pos;
+
+    float near_sq = params->lod.near_distance * params->lod.near_distance;
+    float far_sq = params->lod.far_distance * params->lod.far_distance;
+    int32_t near_count = 0;
+    int32_t mid_count = 0;
 
     for (int i = 0; i < it->count; i++) {
         switch (ai[i].type) {
@@ -377,36 +1128,65 @@ void SimulateAI(ecs_iter_t *it) {
                 break;
             }
             case HOMING: {
-                float rot = -Vector2Angle((Vector2){0, -1}, Vector2Subtract(player_pos, p[i]));
-                r[i] = LerpRad(r[i], rot, it->delta_time*ai[i].max_turning_speed);
+                float dist_sq = Vector2DistanceSqr(player_pos, p[i]);
+
+                // Round robin, keeps coasting on the last velocity in between
+                uint32_t slot = (uint32_t)it->entities[i] + params->tick;
+
+                if (dist_sq < near_sq) {
+                    near_count++;
 
-                v[i] = Vector2Rotate((Vector2){0, -ai[i].max_velocity}, r[i]);
+                    if (slot % params->near_period == 0) {
+                        SteerHoming(p[i], &d[i], &v[i], ai[i], player_pos, it->delta_time * params->near_period);
+                    }
+                } else if (dist_sq < far_sq) {
+                    mid_count++;
+
+                    if (slot % params->mid_period == 0) {
+                        SteerHoming(p[i], &d[i], &v[i], ai[i], player_pos, it->delta_time * params->mid_period);
+                    }
+                } else if (slot % params->lod.far_period == 0) {
+                    // Too far for turning to matter, head straight for the player.
+                    // The direction to it barely changes from one tick to the next
+                    Vector2 dir = Vector2Normalize(Vector2Subtract(player_pos, p[i]));
+                    v[i] = Vector2Scale(dir, ai[i].max_velocity);
+                }
                 break;
             }
         }
     }
+
+    atomic_fetch_add(&params->near_count, near_count);
+    atomic_fetch_add(&params->mid_count, mid_count);
+}
+
+// Part of the simulation rather than drawing, particles expire on their last frame
+void AnimateSprites(ecs_iter_t *it) {
+    Animation *a = ecs_field(it, Animation, 1);
+
+    for (int i = 0; i < it->count; i++) {
+        a[i].time += it->delta_time;
+        if (a[i].time > 1. / a[i].fps) {
+            a[i].time = 0;
+            a[i].cur_frame++;
+            a[i].cur_frame %= FrameCount(a[i]);
+        }
+    }
 }
 
 void DrawAnimation(ecs_iter_t *it) {
     Position *p = ecs_field(it, Position, 1);
-    Rotation *r = ecs_field(it, Rotation, 2);
+    Direction *d = ecs_field(it, Direction, 2);
     Scale *s = ecs_field(it, Scale, 3);
     Animation *a = ecs_field(it, Animation, 4);
 
     for (int i = 0; i < it->count; i++) {
         Rectangle source = {a[i].cur_frame * a[i].frame_width, 0, a[i].frame_width, a[i].sheet.height};
 
-        Rectangle dest = RecEx(p[i], FrameSize(a[i]), r[i], s[i]);
-        Rectangle dest_norot = RecEx(p[i], FrameSize(a[i]), 0, s[i]);
+        Rectangle dest = RecEx(p[i], FrameSize(a[i]), d[i], s[i]);
+        Rectangle dest_norot = RecEx(p[i], FrameSize(a[i]), DIRECTION_UP, s[i]);
 
-        DrawTexturePro(a[i].sheet, source, dest, Vector2Zero(), ToDeg(r[i]), WHITE);
-
-        a[i].time += it->delta_time;
-        if (a[i].time > 1. / a[i].fps) {
-            a[i].time = 0;
-            a[i].cur_frame++;
-            a[i].cur_frame %= FrameCount(a[i]);
-        }
+        DrawTexturePro(a[i].sheet, source, dest, Vector2Zero(), ToDeg(DirectionAngle(d[i])), WHITE);
 
         // Bounding box
         // DrawRectangleLinesEx(dest_norot, 5, RED);
@@ -416,7 +1196,7 @@ void DrawAnimation(ecs_iter_t *it) {
 
 void DrawAnimationIFrames(ecs_iter_t *it) {
     Position *p = ecs_field(it, Position, 1);
-    Rotation *r = ecs_field(it, Rotation, 2);
+    Direction *d = ecs_field(it, Direction, 2);
     Scale *s = ecs_field(it, Scale, 3);
     Animation *a = ecs_field(it, Animation, 4);
     IFrames *im = ecs_field(it, IFrames, 5);
@@ -426,22 +1206,15 @@ void DrawAnimationIFrames(ecs_iter_t *it) {
     for (int i = 0; i < it->count; i++) {
         Rectangle source = {a[i].cur_frame * a[i].frame_width, 0, a[i].frame_width, a[i].sheet.height};
 
-        Rectangle dest = RecEx(p[i], FrameSize(a[i]), r[i], s[i]);
-        Rectangle dest_norot = RecEx(p[i], FrameSize(a[i]), 0, s[i]);
+        Rectangle dest = RecEx(p[i], FrameSize(a[i]), d[i], s[i]);
+        Rectangle dest_norot = RecEx(p[i], FrameSize(a[i]), DIRECTION_UP, s[i]);
 
         if (im[i].cur > 0) {
             BeginShaderMode(*sh_immunity);
-            DrawTexturePro(a[i].sheet, source, dest, Vector2Zero(), ToDeg(r[i]), WHITE);
+            DrawTexturePro(a[i].sheet, source, dest, Vector2Zero(), ToDeg(DirectionAngle(d[i])), WHITE);
             EndShaderMode();
         } else {
-            DrawTexturePro(a[i].sheet, source, dest, Vector2Zero(), ToDeg(r[i]), WHITE);
-        }
-
-        a[i].time += it->delta_time;
-        if (a[i].time > 1. / a[i].fps) {
-            a[i].time = 0;
-            a[i].cur_frame++;
-            a[i].cur_frame %= FrameCount(a[i]);
+            DrawTexturePro(a[i].sheet, source, dest, Vector2Zero(), ToDeg(DirectionAngle(d[i])), WHITE);
         }
 
         // Bounding box
@@ -462,14 +1235,14 @@ void DrawHealth(ecs_iter_t *it) {
 
 void DrawHitBox(ecs_iter_t *it) {
     Position *p = ecs_field(it, Position, 1);
-    Rotation *r = ecs_field(it, Rotation, 2);
+    Direction *d = ecs_field(it, Direction, 2);
     HitBox *hb = ecs_field(it, HitBox, 3);
 
     for (int i = 0; i < it->count; i++) {
         switch(hb[i].type) {
             case LINE: {
-                           Vector2 begin = GetLineBegin(p[i], r[i], hb[i]);
-                           Vector2 end = GetLineEnd(p[i], r[i], hb[i]);
+                           Vector2 begin = GetLineBegin(p[i], d[i], hb[i]);
+                           Vector2 end = GetLineEnd(p[i], d[i], hb[i]);
                            DrawLineEx(begin, end, 3, RED);
                            break;
                        }
@@ -482,6 +1255,8 @@ void DrawHitBox(ecs_iter_t *it) {
 
 typedef struct PlayerInfo {
     Animation anim;
+    Health health;
+    IFrames iframes;
 } PlayerInfo;
 
 ecs_entity_t MakePlayer(ecs_world_t *ecs, PlayerInfo info) {
@@ -491,18 +1266,19 @@ ecs_entity_t MakePlayer(ecs_world_t *ecs, PlayerInfo info) {
 
     ecs_set(ecs, player, Position, {0, 0});
     ecs_set(ecs, player, Velocity, {0, 0});
-    ecs_set(ecs, player, Rotation, {0});
+    ecs_set(ecs, player, Direction, {0, -1});
 
     float scale = 5;
     ecs_set(ecs, player, Scale, {scale});
-    ecs_set(ecs, player, Health, {5});
+    ecs_set_ptr(ecs, player, Health, &info.health);
 
     HitBox hb = CircleHitBox(0, info.anim.sheet.height * scale);
     ecs_set_ptr(ecs, player, HitBox, &hb);
 
     ecs_set(ecs, player, Team, {0});
+    ecs_set(ecs, player, Layer, {LAYER_PLAYER});
     ecs_set(ecs, player, Flags, {EXPLODE_ON_DEATH});
-    ecs_set(ecs, player, IFrames, {16, 0});
+    ecs_set_ptr(ecs, player, IFrames, &info.iframes);
 
     ecs_set_ptr(ecs, player, Animation, &info.anim);
     ecs_set(ecs, player, AIInfo, {NONE});
@@ -510,13 +1286,167 @@ ecs_entity_t MakePlayer(ecs_world_t *ecs, PlayerInfo info) {
     return player;
 }
 
-void DrawBackground(Texture t_bg, Camera2D camera, float offset_scale) {
-    Position top = GetScreenToWorld2D((Vector2){-1, -1}, camera);
-    Position bot = GetScreenToWorld2D((Vector2){GetScreenWidth(), GetScreenHeight()}, camera);
+typedef struct LaserInfo {
+    Animation anim;
+    Position pos;
+    Direction dir;
+    Lifetime lifetime;
+} LaserInfo;
 
-    Position bg_offset = Vector2Scale(camera.target, -offset_scale);
-    bg_offset.x = (int)bg_offset.x % t_bg.width - t_bg.width; 
-    bg_offset.y = (int)bg_offset.y % t_bg.height - t_bg.height;
+ecs_entity_t MakeLaser(ecs_world_t *ecs, LaserInfo info) {
+    COMPONENTS(ecs);
+
+    ecs_entity_t laser = ecs_new_id(ecs);
+
+    ecs_set_ptr(ecs, laser, Direction, &info.dir);
+
+    Velocity vel = Vector2Scale(info.dir, 500);
+    ecs_set_ptr(ecs, laser, Velocity, &vel);
+
+    ecs_set_ptr(ecs, laser, Position, &info.pos);
+
+    float scale = 5;
+    ecs_set(ecs, laser, Scale, {scale});
+
+    ecs_set(ecs, laser, Health, {3});
+    
+    HitBox hb = LineHitBox(1, info.anim.sheet.height * scale);
+    ecs_set_ptr(ecs, laser, HitBox, &hb);
+    
+    ecs_set(ecs, laser, Team, {0});
+    ecs_set(ecs, laser, Layer, {LAYER_PLAYER_PROJECTILE});
+    ecs_set(ecs, laser, Flags, {0});
+    ecs_set(ecs, laser, IFrames, {0, 0});
+    ecs_set_ptr(ecs, laser, Lifetime, &info.lifetime);
+
+    ecs_set_ptr(ecs, laser, Animation, &info.anim);
+    
+    ecs_set(ecs, laser, AIInfo, {NONE});
+
+    return laser;
+}
+
+typedef struct EnemyInfo {
+    Animation anim;
+    Position pos;
+    AIInfo ai;
+    Health health;
+    IFrames iframes;
+} EnemyInfo;
+
+ecs_entity_t MakeEnemy(ecs_world_t *ecs, EnemyInfo info) {
+    COMPONENTS(ecs);
+
+    ecs_entity_t enemy = ecs_new_id(ecs);
+
+    ecs_set(ecs, enemy, Direction, {0, -1});
+
+    ecs_set(ecs, enemy, Velocity, {0, 0});
+
+    ecs_set_ptr(ecs, enemy, Position, &info.pos);
+
+    float scale = 2;
+    ecs_set(ecs, enemy, Scale, {scale});
+
+    ecs_set_ptr(ecs, enemy, Health, &info.health);
+
+    HitBox hb = CircleHitBox(1, info.anim.sheet.height * scale);
+    ecs_set_ptr(ecs, enemy, HitBox, &hb);
+
+    ecs_set(ecs, enemy, Team, {1});
+    ecs_set(ecs, enemy, Layer, {LAYER_ENEMY});
+    ecs_set(ecs, enemy, Flags, {EXPLODE_ON_DEATH | PUSH_ON_COLLISION});
+    ecs_set_ptr(ecs, enemy, IFrames, &info.iframes);
+    
+    ecs_set_ptr(ecs, enemy, AIInfo, &info.ai);
+
+    ecs_set_ptr(ecs, enemy, Animation, &info.anim);
+
+    return enemy;
+}
+
+// Low resolution target the world is drawn into before being scaled up to the window
+typedef struct WorldTarget {
+    RenderTexture2D texture;
+    int32_t scale; // Integer upscale factor, 1 draws straight to the window
+    Rectangle dest; // Where the texture lands in the window
+} WorldTarget;
+
+// (Re)creates the target when the scale or the window size changed
+void ResizeWorldTarget(WorldTarget *t, int32_t scale) {
+    if (scale < 1) scale = 1;
+
+    int width = GetScreenWidth() / scale;
+    int height = GetScreenHeight() / scale;
+
+    bool same_size = t->texture.texture.width == width && t->texture.texture.height == height;
+    if (t->scale == scale && (scale == 1 || same_size)) return;
+
+    if (t->texture.id) {
+        UnloadRenderTexture(t->texture);
+        t->texture = (RenderTexture2D){0};
+    }
+
+    t->scale = scale;
+    t->dest = (Rectangle){0, 0, GetScreenWidth(), GetScreenHeight()};
+    if (scale == 1) return;
+
+    t->texture = LoadRenderTexture(width, height);
+    SetTextureFilter(t->texture.texture, TEXTURE_FILTER_POINT);
+
+    // Centered, the leftover is less than a single scaled pixel
+    t->dest.width = width * scale;
+    t->dest.height = height * scale;
+    t->dest.x = (GetScreenWidth() - t->dest.width) / 2;
+    t->dest.y = (GetScreenHeight() - t->dest.height) / 2;
+}
+
+Vector2 WorldViewSize(const WorldTarget *t) {
+    if (t->scale > 1) return (Vector2){t->texture.texture.width, t->texture.texture.height};
+    return (Vector2){GetScreenWidth(), GetScreenHeight()};
+}
+
+// Returns the camera the world has to be drawn with, camera itself stays in window space
+Camera2D BeginWorld(const WorldTarget *t, Camera2D camera) {
+    if (t->scale <= 1) {
+        BeginMode2D(camera);
+        return camera;
+    }
+
+    Camera2D world = camera;
+    world.offset = Vector2Scale(Vector2Subtract(camera.offset, (Vector2){t->dest.x, t->dest.y}), 1. / t->scale);
+    world.zoom = camera.zoom / t->scale;
+
+    BeginTextureMode(t->texture);
+    ClearBackground(BLACK);
+    BeginMode2D(world);
+
+    return world;
+}
+
+void EndWorld(const WorldTarget *t) {
+    EndMode2D();
+    if (t->scale <= 1) return;
+
+    EndTextureMode();
+
+    // The blit may leave a few columns or rows of the window uncovered
+    ClearBackground(BLACK);
+
+    // Render textures are upside down
+    Rectangle source = {0, 0, t->texture.texture.width, -t->texture.texture.height};
+    DrawTexturePro(t->texture.texture, source, t->dest, Vector2Zero(), 0, WHITE);
+}
+
+void DrawBackground(Texture t_bg, Camera2D camera, Vector2 view, float offset_scale) {
+    if (t_bg.width <= 0 || t_bg.height <= 0) return; // Not loaded (yet)
+
+    Position top = GetScreenToWorld2D((Vector2){-1, -1}, camera);
+    Position bot = GetScreenToWorld2D(view, camera);
+
+    Position bg_offset = Vector2Scale(camera.target, -offset_scale);
+    bg_offset.x = (int)bg_offset.x % t_bg.width - t_bg.width; 
+    bg_offset.y = (int)bg_offset.y % t_bg.height - t_bg.height;
 
     for (int16_t x = bg_offset.x + top.x; x <= bot.x; x += t_bg.width) {
         for (int16_t y = bg_offset.y + top.y; y <= bot.y; y += t_bg.height) {
@@ -525,93 +1455,758 @@ void DrawBackground(Texture t_bg, Camera2D camera, float offset_scale) {
     }
 }
 
-int main(void) {
-    const int screenWidth = 1360;
-    const int screenHeight = 700;
+void *TrackedMalloc(ecs_size_t size) {
+    CountAlloc(size);
+    return malloc(size);
+}
 
-    InitWindow(screenWidth, screenHeight, "starship game");
-    ToggleBorderlessWindowed();
-    ecs_world_t *ecs = ecs_init();
-    ecs_set_threads(ecs, 4);
+void *TrackedCalloc(ecs_size_t size) {
+    CountAlloc(size);
+    return calloc(1, size);
+}
 
-    SetTargetFPS(60);
+void *TrackedRealloc(void *ptr, ecs_size_t size) {
+    CountAlloc(size);
+    return realloc(ptr, size);
+}
 
-    Camera2D camera = {
-        .zoom = 1,
-        .offset = {screenWidth / 2., screenHeight / 2.},
-        .target = {0., 0.},
-        .rotation = 0.,
+void TrackedFree(void *ptr) {
+    if (ptr) CountFree();
+    free(ptr);
+}
+
+// Has to be called before the first world is created
+void InstallAllocHooks(void) {
+#ifdef FLECS_OS_API_IMPL
+    ecs_set_os_api_impl(); // Otherwise ecs_init would skip the threading API once ours is set
+#else
+    ecs_os_set_api_defaults();
+#endif
+
+    ecs_os_api.malloc_ = TrackedMalloc;
+    ecs_os_api.calloc_ = TrackedCalloc;
+    ecs_os_api.realloc_ = TrackedRealloc;
+    ecs_os_api.free_ = TrackedFree;
+
+    alloc_tracking = true;
+}
+
+// Returns the allocations made since the previous call
+AllocStats TakeAllocStats(void) {
+    return (AllocStats){
+        .count = atomic_exchange(&alloc_count, 0),
+        .frees = atomic_exchange(&free_count, 0),
+        .bytes = atomic_exchange(&alloc_bytes, 0),
     };
+}
 
-    Shader sh_immunity = LoadShader(0, ASSET "immunity.fs");
+typedef enum QualityLevel {
+    QUALITY_FULL,
+    QUALITY_FEW_PARTICLES, // Explosions per tick are capped
+    QUALITY_SLOW_AI, // Mid range AI re-steers less often
+    QUALITY_NO_OVERLAYS, // Health and hit box debug drawing is skipped
+    QUALITY_LOW_RES, // The world is rendered at half the resolution
+    QUALITY_LEVEL_COUNT,
+} QualityLevel;
+
+const char *QualityName(QualityLevel level) {
+    switch (level) {
+        case QUALITY_FULL: return "FULL";
+        case QUALITY_FEW_PARTICLES: return "FEW PARTICLES";
+        case QUALITY_SLOW_AI: return "SLOW AI";
+        case QUALITY_NO_OVERLAYS: return "NO OVERLAYS";
+        case QUALITY_LOW_RES: return "LOW RES";
+        default: return "?";
+    }
+}
 
-    int sh_im_time = GetShaderLocation(sh_immunity, "time");
-    float timeSec = 0;
+#define GOVERNOR_WINDOW 60 // Frames of headroom needed before quality is restored
+#define GOVERNOR_SHORT_WINDOW 8 // Frames judged before quality is shed
+#define GOVERNOR_SHORT_OVER 5 // Of those over budget to shed a level, a single hitch doesn't
+#define GOVERNOR_LONG_OVER 3 // Of the long window allowed above half the budget while restoring
+
+// Sheds load one stage at a time while frames go over budget, restores it once there is lasting headroom
+typedef struct Governor {
+    double budget; // Seconds per frame
+
+    // Since the last change, CPU work and present (EndDrawing, where fill rate
+    // shows up) of every frame
+    double cpu[GOVERNOR_WINDOW];
+    double present[GOVERNOR_WINDOW];
+    int32_t count;
+    int32_t next;
+
+    QualityLevel level;
+} Governor;
+
+Governor MakeGovernor(double budget) {
+    return (Governor){.budget = budget};
+}
+
+// One level in direction dir, past the levels that currently shed nothing.
+// Stays put when there is no such level left
+QualityLevel StepQuality(QualityLevel level, int32_t dir, uint32_t noop_levels) {
+    QualityLevel next = level;
+    do {
+        next += dir;
+    } while (next > QUALITY_FULL && next < QUALITY_LEVEL_COUNT && (noop_levels & (1u << next)));
+
+    if (next < QUALITY_FULL || next >= QUALITY_LEVEL_COUNT) return level;
+    return next;
+}
+
+// noop_levels: mask of levels that wouldn't shed anything right now, they are skipped
+void UpdateGovernor(Governor *g, double cpu, double present, uint32_t noop_levels) {
+    g->cpu[g->next] = cpu;
+    g->present[g->next] = present;
+    g->next = (g->next + 1) % GOVERNOR_WINDOW;
+    if (g->count < GOVERNOR_WINDOW) g->count++;
+
+    QualityLevel level = g->level;
+
+    if (g->count >= GOVERNOR_SHORT_WINDOW) {
+        int32_t over = 0, present_bound = 0;
+        for (int k = 1; k <= GOVERNOR_SHORT_WINDOW; k++) {
+            int32_t i = (g->next - k + GOVERNOR_WINDOW) % GOVERNOR_WINDOW;
+            if (g->cpu[i] + g->present[i] > g->budget * 0.9) over++;
+            if (g->present[i] > g->cpu[i]) present_bound++;
+        }
+
+        // A lower resolution only helps when the GPU is what's slow
+        if (present_bound < GOVERNOR_SHORT_OVER) noop_levels |= 1u << QUALITY_LOW_RES;
+
+        if (over >= GOVERNOR_SHORT_OVER) {
+            level = StepQuality(level, 1, noop_levels);
+        }
+    }
+
+    if (level == g->level && level > QUALITY_FULL && g->count == GOVERNOR_WINDOW) {
+        int32_t over = 0;
+        for (int i = 0; i < GOVERNOR_WINDOW; i++) {
+            if (g->cpu[i] + g->present[i] > g->budget * 0.5) over++;
+        }
+
+        // Well under budget for the whole window, so it doesn't oscillate
+        if (over <= GOVERNOR_LONG_OVER) {
+            level = StepQuality(level, -1, noop_levels);
+        }
+    }
 
-    Animation a_starship = {
-        .sheet = LoadTexture(ASSET "starship.png"),
-        .cur_frame = 0,
-        .frame_width = 16,
-        .time = 0,
-        .fps = 8,
+    // Judge the new level on its own frames, so it changes at most once per short window
+    if (level != g->level) {
+        g->level = level;
+        g->count = 0;
+        g->next = 0;
+    }
+}
+
+typedef struct Profiler {
+    AllocStats allocs; // During the last frame
+    int64_t alloc_free_frames; // Consecutive frames without any allocation
+    size_t arena_peak;
+    double input_latency; // Seconds from sampling input to presenting the frame built from it
+    double predicted_work;
+    double work; // CPU time of the frame, without the present
+    QualityLevel quality;
+} Profiler;
+
+void ProfileFrame(Profiler *p, FrameArena *arena) {
+    p->allocs = TakeAllocStats();
+    p->alloc_free_frames = p->allocs.count ? 0 : p->alloc_free_frames + 1;
+    p->arena_peak = arena->peak;
+}
+
+void DrawProfiler(Profiler p, int x, int y) {
+    DrawText(TextFormat("ALLOCS: %lld (%lld B)", (long long)p.allocs.count, (long long)p.allocs.bytes), x, y, 14, RAYWHITE);
+    DrawText(TextFormat("FREES: %lld", (long long)p.allocs.frees), x, y + 16, 14, RAYWHITE);
+    DrawText(TextFormat("ALLOC FREE FRAMES: %lld", (long long)p.alloc_free_frames), x, y + 32, 14, RAYWHITE);
+    DrawText(TextFormat("ARENA PEAK: %zu B", p.arena_peak), x, y + 48, 14, RAYWHITE);
+    DrawText(TextFormat("INPUT LATENCY: %.2f ms", p.input_latency * 1000), x, y + 64, 14, RAYWHITE);
+    DrawText(TextFormat("WORK: %.2f ms (PREDICTED %.2f ms)", p.work * 1000, p.predicted_work * 1000), x, y + 80, 14, RAYWHITE);
+    DrawText(TextFormat("QUALITY: %s", QualityName(p.quality)), x, y + 96, 14, RAYWHITE);
+}
+
+// Sleeps before sampling input instead of after presenting, so a frame is
+// built from input that is as fresh as the predicted work allows
+typedef struct FramePacer {
+    double frame_time; // Seconds per frame
+    double deadline; // When the current frame should be presented
+    double sampled; // When input was sampled for the current frame
+
+    // Moving averages of the CPU work from sampling input to the start of
+    // EndDrawing, the buffer swap is left out as it may block on vsync
+    double work;
+    double work_dev;
+
+    double last_work; // Of the last frame
+    double latency; // Sample to present of the last frame, swap included
+    double last_present; // Time spent in EndDrawing by the last frame
+    double built; // When the current frame was built
+} FramePacer;
+
+FramePacer MakePacer(int32_t fps) {
+    return (FramePacer){
+        .frame_time = 1. / fps,
+        .deadline = GetTime() + 1. / fps,
     };
+}
 
-    Animation a_enemy = {
-        .sheet = LoadTexture(ASSET "Enemy.png"),
-        .frame_width = 32,
-        .fps = 8,
-        
-        .time = 0,
-        .cur_frame = 0,
+// Predicted time to build a frame, with a margin for jitter
+double PredictWork(const FramePacer *p) {
+    return p->work + 2 * p->work_dev;
+}
+
+void WaitForInput(FramePacer *p) {
+    double wake = p->deadline - PredictWork(p);
+    double now = GetTime();
+    if (wake > now) {
+        WaitTime(wake - now);
+    }
+
+    PollInputEvents();
+    p->sampled = GetTime();
+}
+
+// Call right before EndDrawing
+void FrameBuilt(FramePacer *p) {
+    p->built = GetTime();
+    double work = p->built - p->sampled;
+
+    p->last_work = work;
+    p->work_dev += (fabs(work - p->work) - p->work_dev) * 0.1;
+    p->work += (work - p->work) * 0.1;
+}
+
+// Call right after EndDrawing
+void FramePresented(FramePacer *p) {
+    double now = GetTime();
+    p->latency = now - p->sampled;
+    p->last_present = now - p->built;
+
+    p->deadline += p->frame_time;
+    if (p->deadline < now) { // Missed it, or the swap waited for vsync, line up with this present
+        p->deadline = now + p->frame_time;
+    }
+}
+
+// Presses seen by any poll since the last frame, input is polled twice
+// per frame (by EndDrawing and by the pacer) and an edge from either must not be lost
+typedef struct InputLatch {
+    bool left_click;
+    bool right_click;
+    bool toggle_debug;
+} InputLatch;
+
+void LatchInput(InputLatch *l) {
+    l->left_click |= IsMouseButtonPressed(MOUSE_BUTTON_LEFT);
+    l->right_click |= IsMouseButtonPressed(MOUSE_BUTTON_RIGHT);
+    l->toggle_debug |= IsKeyPressed(KEY_F3);
+}
+
+// Deletes every entity matched by the query
+void DeleteAll(ecs_world_t *ecs, ecs_query_t *q) {
+    ecs_defer_begin(ecs);
+
+    ecs_iter_t it = ecs_query_iter(ecs, q);
+    while (ecs_query_next(&it)) {
+        for (int i = 0; i < it.count; ++i) {
+            ecs_delete(ecs, it.entities[i]);
+        }
+    }
+
+    ecs_defer_end(ecs);
+}
+
+int32_t GetCoreCount(void) {
+    long cores = sysconf(_SC_NPROCESSORS_ONLN);
+    return cores > 0 ? cores : 1;
+}
+
+#define MAX_ASSETS 32
+#define MAX_LOADER_THREADS 8
+
+typedef enum AssetState {
+    ASSET_PENDING,
+    ASSET_DECODED,
+    ASSET_FAILED, // Couldn't be decoded, the texture stays empty
+    ASSET_UPLOADED,
+} AssetState;
+
+typedef struct AssetJob {
+    const char *path;
+    Texture *target; // Written on the main thread once uploaded
+
+    Image image;
+    atomic_int state;
+} AssetJob;
+
+// Decodes images on worker threads, textures are uploaded on the main thread
+typedef struct AssetLoader {
+    AssetJob jobs[MAX_ASSETS];
+    int32_t count;
+    int32_t uploaded;
+    int32_t failed;
+
+    atomic_int next; // Next job to be picked up by a worker
+
+    pthread_t threads[MAX_LOADER_THREADS];
+    int32_t thread_count;
+} AssetLoader;
+
+void QueueAsset(AssetLoader *l, const char *path, Texture *target) {
+    assert(l->count < MAX_ASSETS);
+
+    *target = (Texture){0};
+
+    AssetJob *job = &l->jobs[l->count++];
+    job->path = path;
+    job->target = target;
+    atomic_init(&job->state, ASSET_PENDING);
+}
+
+void *DecodeAssets(void *arg) {
+    AssetLoader *l = arg;
+
+    int32_t i;
+    while ((i = atomic_fetch_add(&l->next, 1)) < l->count) {
+        l->jobs[i].image = LoadImage(l->jobs[i].path);
+
+        if (!l->jobs[i].image.data) {
+            fprintf(stderr, "Couldn't load %s\n", l->jobs[i].path);
+            atomic_store(&l->jobs[i].state, ASSET_FAILED);
+            continue;
+        }
+        atomic_store(&l->jobs[i].state, ASSET_DECODED);
+    }
+
+    return NULL;
+}
+
+void StartAssetLoader(AssetLoader *l, int32_t max_threads) {
+    atomic_init(&l->next, 0);
+
+    l->thread_count = l->count;
+    if (l->thread_count > max_threads) l->thread_count = max_threads;
+    if (l->thread_count > MAX_LOADER_THREADS) l->thread_count = MAX_LOADER_THREADS;
+
+    for (int i = 0; i < l->thread_count; i++) {
+        if (pthread_create(&l->threads[i], NULL, DecodeAssets, l) != 0) {
+            l->thread_count = i;
+            break;
+        }
+    }
+
+    if (l->thread_count == 0) { // Couldn't spawn anything, decode right here
+        DecodeAssets(l);
+    }
+}
+
+// Uploads every image decoded so far, returns true once every asset is either loaded or failed
+bool UploadAssets(AssetLoader *l) {
+    for (int i = 0; i < l->count && l->uploaded + l->failed < l->count; i++) {
+        AssetJob *job = &l->jobs[i];
+
+        switch (atomic_load(&job->state)) {
+            case ASSET_DECODED:
+                *job->target = LoadTextureFromImage(job->image);
+                UnloadImage(job->image);
+
+                atomic_store(&job->state, ASSET_UPLOADED);
+                l->uploaded++;
+                break;
+
+            case ASSET_FAILED:
+                atomic_store(&job->state, ASSET_UPLOADED); // Counted, leave it alone from now on
+                l->failed++;
+                break;
+
+            default:
+                break;
+        }
+    }
+
+    return l->uploaded + l->failed == l->count;
+}
+
+void StopAssetLoader(AssetLoader *l) {
+    for (int i = 0; i < l->thread_count; i++) {
+        pthread_join(l->threads[i], NULL);
+    }
+    l->thread_count = 0;
+
+    // Closed before everything was uploaded
+    for (int i = 0; i < l->count; i++) {
+        if (atomic_load(&l->jobs[i].state) == ASSET_DECODED) {
+            UnloadImage(l->jobs[i].image);
+            atomic_store(&l->jobs[i].state, ASSET_PENDING);
+        }
+    }
+}
+
+#define SECTOR_SIZE 2048.f
+#define SECTOR_BUCKETS 256 // Power of two
+
+typedef struct SectorKey {
+    int32_t x, y;
+} SectorKey;
+
+// Entities asleep in one sector, disabled in flecs so no query visits them
+typedef struct Sector {
+    SectorKey key;
+    ecs_entity_t *entities;
+    int32_t count;
+    int32_t capacity;
+    struct Sector *next; // In the same bucket
+} Sector;
+
+// Puts sectors far from the player to sleep and wakes them up as the player comes back
+typedef struct SectorStore {
+    Sector *buckets[SECTOR_BUCKETS];
+
+    // In sectors, wake_radius < sleep_radius so the border doesn't flicker
+    int32_t sleep_radius;
+    int32_t wake_radius;
+    uint8_t sleep_layers; // Mask of layers that may sleep
+
+    int32_t period; // Ticks between sleep passes
+    int32_t asleep;
+
+    ecs_query_t *q_awake;
+} SectorStore;
+
+SectorKey GetSectorKey(Position p) {
+    return (SectorKey){floorf(p.x / SECTOR_SIZE), floorf(p.y / SECTOR_SIZE)};
+}
+
+int32_t SectorDistance(SectorKey a, SectorKey b) {
+    int32_t dx = abs(a.x - b.x);
+    int32_t dy = abs(a.y - b.y);
+    return dx > dy ? dx : dy;
+}
+
+Sector **SectorBucket(SectorStore *store, SectorKey key) {
+    uint32_t hash = ((uint32_t)key.x * 73856093u) ^ ((uint32_t)key.y * 19349663u);
+    return &store->buckets[hash & (SECTOR_BUCKETS - 1)];
+}
+
+Sector *FindSector(SectorStore *store, SectorKey key) {
+    for (Sector *s = *SectorBucket(store, key); s; s = s->next) {
+        if (s->key.x == key.x && s->key.y == key.y) return s;
+    }
+    return NULL;
+}
+
+Sector *GetSector(SectorStore *store, SectorKey key) {
+    Sector *s = FindSector(store, key);
+    if (s) return s;
+
+    Sector **bucket = SectorBucket(store, key);
+    s = ecs_os_calloc(sizeof(Sector)); // Through the OS API so the profiler counts it
+    if (!s) return NULL;
+
+    s->key = key;
+    s->next = *bucket;
+    *bucket = s;
+    return s;
+}
+
+// Returns false when the list couldn't grow, the entity should then stay awake
+bool SectorPush(Sector *s, ecs_entity_t e) {
+    if (s->count == s->capacity) {
+        int32_t capacity = s->capacity ? s->capacity * 2 : 16;
+        ecs_entity_t *entities = ecs_os_realloc(s->entities, capacity * sizeof(ecs_entity_t));
+        if (!entities) return false;
+
+        s->entities = entities;
+        s->capacity = capacity;
+    }
+    s->entities[s->count++] = e;
+    return true;
+}
+
+void InitSectors(SectorStore *store, ecs_world_t *ecs) {
+    COMPONENTS(ecs);
+
+    *store = (SectorStore){
+        .sleep_radius = 3,
+        .wake_radius = 2,
+        .sleep_layers = 1 << LAYER_ENEMY,
+        .period = 30,
+    };
+
+    store->q_awake = ecs_query(ecs, {
+        .filter.terms = {
+            {ecs_id(Position), .inout = EcsIn},
+            {ecs_id(Layer), .inout = EcsIn},
+        }
+    });
+}
+
+// Forgets every sleeping entity, sectors keep their storage for reuse
+void ClearSectors(SectorStore *store) {
+    for (int b = 0; b < SECTOR_BUCKETS; b++) {
+        for (Sector *s = store->buckets[b]; s; s = s->next) {
+            s->count = 0;
+        }
+    }
+    store->asleep = 0;
+}
+
+void FreeSectors(SectorStore *store) {
+    for (int b = 0; b < SECTOR_BUCKETS; b++) {
+        Sector *s = store->buckets[b];
+        while (s) {
+            Sector *next = s->next;
+            ecs_os_free(s->entities);
+            ecs_os_free(s);
+            s = next;
+        }
+        store->buckets[b] = NULL;
+    }
+    ecs_query_fini(store->q_awake);
+}
+
+void WakeSectors(SectorStore *store, ecs_world_t *ecs, SectorKey center) {
+    int32_t r = store->wake_radius;
+
+    ecs_defer_begin(ecs);
+    for (int32_t y = center.y - r; y <= center.y + r; y++) {
+        for (int32_t x = center.x - r; x <= center.x + r; x++) {
+            Sector *s = FindSector(store, (SectorKey){x, y});
+            if (!s) continue;
+
+            for (int i = 0; i < s->count; i++) {
+                if (ecs_is_alive(ecs, s->entities[i])) {
+                    ecs_enable(ecs, s->entities[i], true);
+                }
+            }
+            store->asleep -= s->count;
+            s->count = 0;
+        }
+    }
+    ecs_defer_end(ecs);
+}
+
+void SleepSectors(SectorStore *store, ecs_world_t *ecs, SectorKey center) {
+    ecs_defer_begin(ecs);
+
+    ecs_iter_t it = ecs_query_iter(ecs, store->q_awake);
+    while (ecs_query_next(&it)) {
+        Position *p = ecs_field(&it, Position, 1);
+        Layer *l = ecs_field(&it, Layer, 2);
+
+        for (int i = 0; i < it.count; i++) {
+            if (!(store->sleep_layers & (1 << l[i]))) continue;
+
+            SectorKey key = GetSectorKey(p[i]);
+            if (SectorDistance(key, center) <= store->sleep_radius) continue;
+
+            Sector *sector = GetSector(store, key);
+            if (!sector || !SectorPush(sector, it.entities[i])) continue; // Out of memory, leave it awake
+
+            ecs_enable(ecs, it.entities[i], false);
+            store->asleep++;
+        }
+    }
+
+    ecs_defer_end(ecs);
+}
+
+// Wakes nearby sectors every tick, puts distant entities to sleep every period ticks
+void StreamSectors(SectorStore *store, ecs_world_t *ecs, Position player_pos, uint32_t tick) {
+    SectorKey center = GetSectorKey(player_pos);
+
+    if (store->asleep > 0) {
+        WakeSectors(store, ecs, center);
+    }
+
+    if (tick % store->period == 0) {
+        SleepSectors(store, ecs, center);
+    }
+}
+
+typedef struct Sprites {
+    Animation starship;
+    Animation enemy;
+    Animation laser;
+    Animation explosion;
+} Sprites;
+
+// Frame layout of every sprite, the sheets themselves are loaded separately
+Sprites DefaultSprites(void) {
+    return (Sprites){
+        .starship = {
+            .cur_frame = 0,
+            .frame_width = 16,
+            .time = 0,
+            .fps = 8,
+        },
+        .enemy = {
+            .frame_width = 32,
+            .fps = 8,
+
+            .time = 0,
+            .cur_frame = 0,
+        },
+        .laser = {
+            .cur_frame = 0,
+            .frame_width = 1,
+            .time = 0,
+            .fps = 60,
+        },
+        .explosion = {
+            .cur_frame = 0,
+            .frame_width = 16,
+            .time = 0,
+            .fps = 8,
+        },
     };
+}
 
+// Gameplay values worth balancing, the batch runner can override them
+typedef struct Tuning {
+    AIInfo enemy_ai;
+    Health enemy_health;
+    IFrames enemy_iframes;
+
+    Health player_health;
+    IFrames player_iframes;
+
+    Lifetime laser_lifetime;
+    float cull_distance; // Projectiles further than this from the player are removed
+} Tuning;
+
+Tuning DefaultTuning(void) {
+    return (Tuning){
+        .enemy_ai = {
+            .type = HOMING,
+            .max_velocity = 100,
+            .max_turning_speed = PI,
+        },
+        .enemy_health = 3,
+        .enemy_iframes = {.init = 16, .cur = 0},
 
-    Animation a_laser = {
-        .sheet = LoadTexture(ASSET "laser.png"),
-        .cur_frame = 0,
-        .frame_width = 1,
-        .time = 0,
-        .fps = 60,
+        .player_health = 5,
+        .player_iframes = {.init = 16, .cur = 0},
+
+        .laser_lifetime = 3,
+        .cull_distance = 4000,
     };
+}
 
-    Animation a_explosion = (Animation){
-        .sheet = LoadTexture(ASSET "Explosion.png"),
-        .cur_frame = 0,
-        .frame_width = 16,
-        .time = 0,
-        .fps = 8,
+// Input for a single tick, from the keyboard and mouse or from a script
+typedef struct GameInput {
+    bool left, right, up, down;
+    bool fire;
+
+    bool spawn_enemy;
+    Position spawn_pos;
+} GameInput;
+
+// A world with its systems, independent from the window
+typedef struct Game {
+    ecs_world_t *ecs;
+    Scheduler *scheduler; // NULL runs every system on the calling thread
+
+    Sprites sprites;
+    Tuning tuning;
+
+    FrameArena frame_arena;
+    CollisionLayers collision_layers;
+    AIParams ai_params;
+    HealthParams health_params;
+    CullParams cull_params;
+    SectorStore sectors;
+
+    // Every entity (that has a flags component), created once so resets don't allocate a query
+    ecs_query_t *q_everything;
+
+    ecs_entity_t move;
+    ecs_entity_t collisions;
+    ecs_entity_t healthCheck;
+    ecs_entity_t animate;
+    ecs_entity_t removeParticles;
+    ecs_entity_t decrementIFrames;
+    ecs_entity_t cullExpired;
+    ecs_entity_t simAI;
+
+    ecs_entity_t draw;
+    ecs_entity_t drawIFrames;
+    ecs_entity_t drawHB;
+    ecs_entity_t drawHealth;
+
+    ecs_entity_t player;
+    Position player_pos;
+    Velocity player_vel;
+
+    uint32_t tick;
+} Game;
+
+// The game keeps pointers into itself, so it must not move afterwards
+void InitGame(Game *g, Sprites sprites, Tuning tuning, Scheduler *scheduler) {
+    *g = (Game){
+        .ecs = ecs_init(),
+        .scheduler = scheduler,
+        .sprites = sprites,
+        .tuning = tuning,
+        .ai_params = {
+            .lod = {
+                .near_distance = 800,
+                .far_distance = 3000,
+                .mid_period = 4,
+                .far_period = 30,
+                .steer_budget = 512,
+            },
+        },
     };
 
-    Texture t_bg = LoadTexture(ASSET "Background.png");
-    Texture t_mg = LoadTexture(ASSET "Midground.png");
-    Texture t_fg = LoadTexture(ASSET "Foreground.png");
+    ecs_world_t *ecs = g->ecs;
 
-    Texture t_heart = LoadTexture(ASSET "Heart.png");
+    // One stage per worker, systems are scheduled by us rather than by a flecs pipeline
+    if (scheduler) {
+        ecs_set_stage_count(ecs, scheduler->worker_count);
+    }
 
-    GameState gs = MAIN_MENU;
+    g->collision_layers = (CollisionLayers){
+        .matrix = DefaultCollisionMatrix(),
+        .arena = &g->frame_arena,
+        .scheduler = scheduler,
+    };
 
-    COMPONENTS(ecs);
+    g->health_params = (HealthParams){
+        .explosion = &g->sprites.explosion,
+        .explosion_cap = -1,
+    };
 
-    AIInfo default_homing_ai = {
-        .type = HOMING,
-        .max_velocity = 100,
-        .max_turning_speed = PI,
+    g->cull_params = (CullParams){
+        .max_distance = tuning.cull_distance,
     };
 
-    ecs_entity_t move = ecs_system(ecs, {
+    COMPONENTS(ecs);
+
+    g->q_everything = ecs_query(ecs, {
+        .filter.terms = {
+            {ecs_id(Flags)},
+            {EcsDisabled, .oper = EcsOptional}, // Sleeping entities too
+        }
+    });
+
+    InitSectors(&g->sectors, ecs);
+
+    g->move = ecs_system(ecs, {
         .entity = ecs_entity(ecs, {
                 .name = "Move"
         }),
         .query.filter.terms = {
             {.id = ecs_id(Position)},
             {.id = ecs_id(Velocity)},
-            {.id = ecs_id(Rotation)},
+            {.id = ecs_id(Direction)},
         },
         .callback = Move,
         .multi_threaded = true, 
     });
 
-    ecs_entity_t collisions = ecs_system(ecs, {
+    g->collisions = ecs_system(ecs, {
         .entity = ecs_entity(ecs, {
             .name = "Collisions"
         }),
@@ -620,32 +2215,46 @@ int main(void) {
             {.id = ecs_id(Flags), .inout = EcsIn},
             {.id = ecs_id(Position), .inout = EcsInOut},
             {.id = ecs_id(Velocity), .inout = EcsInOut},
-            {.id = ecs_id(Rotation), .inout = EcsIn},
+            {.id = ecs_id(Direction), .inout = EcsIn},
 
             {.id = ecs_id(HitBox), .inout = EcsIn},
             {.id = ecs_id(Team), .inout = EcsIn},
+            {.id = ecs_id(Layer), .inout = EcsIn},
 
             {.id = ecs_id(Health), .inout = EcsInOut},
             {.id = ecs_id(IFrames), .inout = EcsInOut},
             {.id = ecs_id(AIInfo), .inout = EcsInOutNone, .oper = EcsOptional},
         },
-        .callback = Collisions,
-        .multi_threaded = true, 
+        // Pairs entities across every matched table, so it iterates the query itself
+        .run = Collisions,
+        .ctx = &g->collision_layers,
     });
 
-    ecs_entity_t healthCheck = ecs_system(ecs, {
+    g->healthCheck = ecs_system(ecs, {
         .entity = ecs_entity(ecs, {
             .name = "HealthCheck"
         }),
         .query.filter.terms = {
             {.id = ecs_id(Health)},
             {.id = ecs_id(Flags)},
+            {.id = ecs_id(Layer)},
         },
         .callback = HealthCheck,
         .multi_threaded = true, 
     });
+
+    g->animate = ecs_system(ecs, {
+        .entity = ecs_entity(ecs, {
+            .name = "AnimateSprites",
+        }),
+        .query.filter.terms = {
+            {.id = ecs_id(Animation)},
+        },
+        .callback = AnimateSprites,
+        .multi_threaded = true, 
+    });
     
-    ecs_entity_t removeParticles = ecs_system(ecs, {
+    g->removeParticles = ecs_system(ecs, {
         .entity = ecs_entity(ecs, {
             .name = "RemoveParticles",
         }),
@@ -657,7 +2266,7 @@ int main(void) {
         .multi_threaded = true, 
     });
     
-    ecs_entity_t decrementIFrames = ecs_system(ecs, {
+    g->decrementIFrames = ecs_system(ecs, {
         .entity = ecs_entity(ecs, {
             .name = "DecrementIFrames",
         }),
@@ -668,14 +2277,26 @@ int main(void) {
         .multi_threaded = true, 
     });
 
-    ecs_entity_t simAI = ecs_system(ecs, {
+    g->cullExpired = ecs_system(ecs, {
+        .entity = ecs_entity(ecs, {
+            .name = "CullExpired",
+        }),
+        .query.filter.terms = {
+            {.id = ecs_id(Position), .inout = EcsIn},
+            {.id = ecs_id(Lifetime)},
+        },
+        .callback = CullExpired,
+        .multi_threaded = true, 
+    });
+
+    g->simAI = ecs_system(ecs, {
         .entity = ecs_entity(ecs, {
             .name = "AISimulation"
         }),
         .query.filter.terms = {
             {.id = ecs_id(Flags)},
             {.id = ecs_id(Position)},
-            {.id = ecs_id(Rotation)},
+            {.id = ecs_id(Direction)},
             {.id = ecs_id(Velocity)},
             {.id = ecs_id(AIInfo)},
         },
@@ -683,13 +2304,13 @@ int main(void) {
         .multi_threaded = true, 
     });
 
-    ecs_entity_t draw = ecs_system(ecs, {
+    g->draw = ecs_system(ecs, {
         .entity = ecs_entity(ecs, {
             .name = "Draw"
         }),
         .query.filter.terms = {
             { .id = ecs_id(Position)},
-            { .id = ecs_id(Rotation)},
+            { .id = ecs_id(Direction)},
             { .id = ecs_id(Scale)},
             { .id = ecs_id(Animation)},
             { .id = ecs_id(IFrames), .oper = EcsNot},
@@ -698,13 +2319,13 @@ int main(void) {
         .multi_threaded = true, 
     });
 
-    ecs_entity_t drawIFrames = ecs_system(ecs, {
+    g->drawIFrames = ecs_system(ecs, {
                 .entity = ecs_entity(ecs, {
                     .name = "DrawIFrames"
                 }),
                 .query.filter.terms = {
                     { .id = ecs_id(Position)},
-                    { .id = ecs_id(Rotation)},
+                    { .id = ecs_id(Direction)},
                     { .id = ecs_id(Scale)},
                     { .id = ecs_id(Animation)},
                     { .id = ecs_id(IFrames)},
@@ -713,163 +2334,612 @@ int main(void) {
                 .multi_threaded = true, 
             });
     
-    ecs_entity_t drawHB = ecs_system(ecs, {
+    g->drawHB = ecs_system(ecs, {
                 .entity = ecs_entity(ecs, {
                     .name = "DrawHitBoxes"
                 }),
                 .query.filter.terms = {
                     { .id = ecs_id(Position)},
-                    { .id = ecs_id(Rotation)},
+                    { .id = ecs_id(Direction)},
                     { .id = ecs_id(HitBox)},
                 },
                 .callback = DrawHitBox, 
                 .multi_threaded = true,
             });
+
+    g->drawHealth = ecs_system(ecs, {
+                .entity = ecs_entity(ecs, {
+                    .name = "DrawHealth"
+                }),
+                .query.filter.terms = {
+                    { .id = ecs_id(Position)},
+                    { .id = ecs_id(Health)},
+                },
+                .callback = DrawHealth, 
+                .multi_threaded = true,
+            });
+}
+
+void FiniGame(Game *g) {
+    ecs_query_fini(g->q_everything);
+    FreeSectors(&g->sectors);
+    ecs_fini(g->ecs);
+
+    FreeArena(&g->frame_arena);
+    for (int w = 0; w < MAX_WORKERS; w++) {
+        FreeArena(&g->collision_layers.worker_arenas[w]);
+    }
+}
+
+// Simulation side of a quality level, drawing is up to the caller
+void SetQuality(Game *g, QualityLevel level) {
+    g->health_params.explosion_cap = level >= QUALITY_FEW_PARTICLES ? 2 : -1;
+    g->ai_params.slowdown = level >= QUALITY_SLOW_AI ? 2 : 1;
+}
+
+// Clears the world and spawns a fresh player
+void ResetGame(Game *g) {
+    DeleteAll(g->ecs, g->q_everything);
+    ClearSectors(&g->sectors);
+
+    g->player = MakePlayer(g->ecs, (PlayerInfo){
+        .anim = g->sprites.starship,
+        .health = g->tuning.player_health,
+        .iframes = g->tuning.player_iframes,
+    });
+
+    g->player_pos = (Position){0, 0};
+    g->player_vel = (Velocity){0, 0};
+    g->health_params.kills = 0;
+}
+
+void ApplyInput(Game *g, GameInput in) {
+    COMPONENTS(g->ecs);
+
+    ecs_world_t *ecs = g->ecs;
+    ecs_entity_t player = g->player;
+    Velocity player_vel = g->player_vel;
+
+    bool changed = false;
+
+    if (in.right) {
+        player_vel.x = Clamp(player_vel.x + 200, -200, 200);
+        changed = true;
+    }
+    if (in.left) {
+        player_vel.x = Clamp(player_vel.x - 200, -200, 200);
+        changed = true;
+    }
+    if (!changed) { // Slow down if no movement keys are pressed
+        player_vel.x = Lerp(player_vel.x, 0, 0.3);
+    }
+    changed = false;
+
+    if (in.up) {
+        player_vel.y = Clamp(player_vel.y - 200, -200, 200);
+        changed = true;
+    }
+    if (in.down) {
+        player_vel.y = Clamp(player_vel.y + 200, -200, 200);
+        changed = true;
+    }
+    if (!changed) { // Slow down if no movement keys are pressed
+        player_vel.y = Lerp(player_vel.y, 0, 0.3);
+    }
+
+    g->player_vel = player_vel;
+    ecs_set_ptr(ecs, player, Velocity, &player_vel);
+
+    if (in.fire) {
+        Direction dir = *ecs_get(ecs, player, Direction);
+
+        MakeLaser(ecs, (LaserInfo){
+            .anim = g->sprites.laser,
+            .pos = Vector2MoveDirection(*ecs_get(ecs, player, Position), 3 * g->sprites.starship.sheet.height, dir),
+            .dir = dir,
+            .lifetime = g->tuning.laser_lifetime,
+        });
+    }
+
+    if (in.spawn_enemy) {
+        MakeEnemy(ecs, (EnemyInfo){
+            .anim = g->sprites.enemy,
+            .pos = in.spawn_pos,
+            .ai = g->tuning.enemy_ai,
+            .health = g->tuning.enemy_health,
+            .iframes = g->tuning.enemy_iframes,
+        });
+    }
+}
+
+// Advances the simulation by one tick
+void StepGame(Game *g, GameInput in, float dt) {
+    COMPONENTS(g->ecs);
+
+    ResetArena(&g->frame_arena);
+
+    if (ecs_is_valid(g->ecs, g->player)) {
+        g->player_vel = *ecs_get(g->ecs, g->player, Velocity);
+        g->player_pos = *ecs_get(g->ecs, g->player, Position);
+
+        ApplyInput(g, in);
+    }
+
+    StreamSectors(&g->sectors, g->ecs, g->player_pos, g->tick++);
+
+    PrepareAI(&g->ai_params, g->player_pos);
+    RunParallel(g->scheduler, g->ecs, g->simAI, dt, &g->ai_params);
+    ecs_run(g->ecs, g->collisions, dt, 0);
+    RunParallel(g->scheduler, g->ecs, g->move, dt, 0);
     
-    while (!WindowShouldClose()) {
-        BeginDrawing();
-        BeginMode2D(camera);
-        const float dt = GetFrameTime();
+    RunParallel(g->scheduler, g->ecs, g->animate, dt, 0);
+    RunParallel(g->scheduler, g->ecs, g->removeParticles, dt, 0);
+    RunParallel(g->scheduler, g->ecs, g->decrementIFrames, dt, 0);
 
-        timeSec += dt;
-        SetShaderValue(sh_immunity, sh_im_time, &timeSec, SHADER_UNIFORM_FLOAT);
+    g->cull_params.center = g->player_pos;
+    RunParallel(g->scheduler, g->ecs, g->cullExpired, dt, &g->cull_params);
+
+    g->health_params.explosions = 0;
+    ecs_run(g->ecs, g->healthCheck, dt, &g->health_params); // Spawns explosions, stays on the main thread
+}
+
+#define MAX_BATCH_RUNS 1000000
+
+typedef struct Settings {
+    int32_t threads;
+    int32_t render_scale; // Window pixels per world pixel
+
+    // Headless batch mode, runs that many games instead of opening a window
+    int32_t batch_runs;
+    const char *batch_out;
+    uint32_t batch_seed;
+    int32_t batch_max_ticks;
 
-        static ecs_entity_t player = 0;
+    Tuning tuning;
+} Settings;
 
-        static Position player_pos = {0, 0};
-        static Velocity player_vel = {0, 0};
+// Defaults, overridden by the environment, overridden by the command line
+Settings ParseSettings(int argc, char **argv) {
+    Settings settings = {
+        .threads = GetCoreCount(),
+        .render_scale = 1,
+
+        .batch_runs = 0,
+        .batch_out = "batch_results.csv",
+        .batch_seed = 1,
+        .batch_max_ticks = 60 * 60 * 10,
+
+        .tuning = DefaultTuning(),
+    };
+
+    const char *env_threads = getenv("STARSHIP_THREADS");
+    if (env_threads && atoi(env_threads) > 0) {
+        settings.threads = atoi(env_threads);
+    }
+
+    const char *env_render_scale = getenv("STARSHIP_RENDER_SCALE");
+    if (env_render_scale && atoi(env_render_scale) > 0) {
+        settings.render_scale = atoi(env_render_scale);
+    }
 
-        if (ecs_is_valid(ecs, player)) {
-            player_vel = *ecs_get(ecs, player, Velocity);
-            player_pos = *ecs_get(ecs, player, Position);
+    for (int i = 1; i < argc; i++) {
+        if (strcmp(argv[i], "--threads") == 0 && i + 1 < argc) {
+            settings.threads = atoi(argv[++i]);
+        } else if (strcmp(argv[i], "--render-scale") == 0 && i + 1 < argc) {
+            settings.render_scale = atoi(argv[++i]);
+        } else if (strcmp(argv[i], "--batch") == 0 && i + 1 < argc) {
+            settings.batch_runs = atoi(argv[++i]);
+        } else if (strcmp(argv[i], "--out") == 0 && i + 1 < argc) {
+            settings.batch_out = argv[++i];
+        } else if (strcmp(argv[i], "--seed") == 0 && i + 1 < argc) {
+            settings.batch_seed = strtoul(argv[++i], NULL, 10);
+        } else if (strcmp(argv[i], "--max-ticks") == 0 && i + 1 < argc) {
+            settings.batch_max_ticks = atoi(argv[++i]);
+        } else if (strcmp(argv[i], "--enemy-velocity") == 0 && i + 1 < argc) {
+            settings.tuning.enemy_ai.max_velocity = atof(argv[++i]);
+        } else if (strcmp(argv[i], "--enemy-turning") == 0 && i + 1 < argc) {
+            settings.tuning.enemy_ai.max_turning_speed = atof(argv[++i]);
+        } else if (strcmp(argv[i], "--enemy-health") == 0 && i + 1 < argc) {
+            settings.tuning.enemy_health = atoi(argv[++i]);
+        } else if (strcmp(argv[i], "--enemy-iframes") == 0 && i + 1 < argc) {
+            settings.tuning.enemy_iframes.init = atoi(argv[++i]);
+        } else if (strcmp(argv[i], "--laser-lifetime") == 0 && i + 1 < argc) {
+            settings.tuning.laser_lifetime = atof(argv[++i]);
+        } else if (strcmp(argv[i], "--player-health") == 0 && i + 1 < argc) {
+            settings.tuning.player_health = atoi(argv[++i]);
+        } else if (strcmp(argv[i], "--player-iframes") == 0 && i + 1 < argc) {
+            settings.tuning.player_iframes.init = atoi(argv[++i]);
+        } else {
+            fprintf(stderr, "Unknown argument: %s\n", argv[i]);
         }
-        
-        // ---------------- PROCESSING ----------------
-        
-        if (ecs_is_valid(ecs, player)) { 
-            // Player controls
+    }
 
-            bool changed = false;
+    if (settings.threads < 1) settings.threads = 1;
+    if (settings.threads > MAX_WORKERS) settings.threads = MAX_WORKERS;
+    if (settings.render_scale < 1) settings.render_scale = 1;
+    if (settings.batch_max_ticks < 1) settings.batch_max_ticks = 1;
 
-            if (IsKeyDown(KEY_RIGHT)) {
-                player_vel.x = Clamp(player_vel.x + 200, -200, 200);
-                changed = true;
-            }
-            if (IsKeyDown(KEY_LEFT)) {
-                player_vel.x = Clamp(player_vel.x - 200, -200, 200);
-                changed = true;
-            }
-            if (!changed) { // Slow down if no movement keys are pressed
-                player_vel.x = Lerp(player_vel.x, 0, 0.3);
-            }
-            changed = false;
+    if (settings.batch_runs < 0 || settings.batch_runs > MAX_BATCH_RUNS) {
+        fprintf(stderr, "--batch takes 1 to %d runs\n", MAX_BATCH_RUNS);
+        exit(1);
+    }
 
-            if (IsKeyDown(KEY_UP)) {
-                player_vel.y = Clamp(player_vel.y - 200, -200, 200);
-                changed = true;
-            }
-            if (IsKeyDown(KEY_DOWN)) {
-                player_vel.y = Clamp(player_vel.y + 200, -200, 200);
-                changed = true;
-            }
-            if (!changed) { // Slow down if no movement keys are pressed
-                player_vel.y = Lerp(player_vel.y, 0, 0.3);
-            }
+    return settings;
+}
+
+double NowSeconds(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + ts.tv_nsec * 1e-9;
+}
 
-            ecs_set_ptr(ecs, player, Velocity, &player_vel);
+// xorshift32, every run gets its own state so runs are reproducible from their seed
+uint32_t NextRandom(uint32_t *state) {
+    uint32_t x = *state;
+    x ^= x << 13;
+    x ^= x >> 17;
+    x ^= x << 5;
+    return *state = x;
+}
 
-            if (IsMouseButtonPressed(MOUSE_BUTTON_LEFT)) {
-                ecs_entity_t laser = ecs_new_id(ecs);
+float RandomFloat(uint32_t *state) {
+    return (NextRandom(state) >> 8) * (1.f / (1 << 24));
+}
 
-                const Rotation* rot = ecs_get(ecs, player, Rotation);
-                ecs_set_ptr(ecs, laser, Rotation, rot);
+// Only the sheet sizes matter without a window, they decide the hit boxes
+bool LoadSpriteSizes(Sprites *sprites) {
+    struct {
+        const char *path;
+        Texture *sheet;
+    } sheets[] = {
+        {ASSET "starship.png", &sprites->starship.sheet},
+        {ASSET "Enemy.png", &sprites->enemy.sheet},
+        {ASSET "laser.png", &sprites->laser.sheet},
+        {ASSET "Explosion.png", &sprites->explosion.sheet},
+    };
 
-                Velocity vel = Vector2Rotate((Vector2){0, -500}, *ecs_get(ecs, player, Rotation));
-                ecs_set_ptr(ecs, laser, Velocity, &vel);
+    for (size_t i = 0; i < sizeof(sheets) / sizeof(sheets[0]); i++) {
+        Image image = LoadImage(sheets[i].path);
+        if (!image.data) { // Empty sheets would have no frames to animate
+            fprintf(stderr, "Couldn't load %s\n", sheets[i].path);
+            return false;
+        }
 
-                Velocity init_vel = Vector2Rotate((Vector2){0, -3 * a_starship.sheet.height}, *ecs_get(ecs, player, Rotation));
-                Position pos = Vector2Add(init_vel, *ecs_get(ecs, player, Position));
-                ecs_set_ptr(ecs, laser, Position, &pos);
+        *sheets[i].sheet = (Texture){
+            .width = image.width,
+            .height = image.height,
+            .mipmaps = image.mipmaps,
+            .format = image.format,
+        };
+        UnloadImage(image);
+    }
 
-                float scale = 5;
-                ecs_set(ecs, laser, Scale, {scale});
+    return true;
+}
 
-                ecs_set(ecs, laser, Health, {3});
-                
-                HitBox hb = LineHitBox(1, a_laser.sheet.height * scale);
-                ecs_set_ptr(ecs, laser, HitBox, &hb);
-                
-                ecs_set(ecs, laser, Team, {0});
-                ecs_set(ecs, laser, Flags, {0});
-                ecs_set(ecs, laser, IFrames, {0, 0});
+// Wanders around, shoots constantly and gets swarmed by more and more enemies
+GameInput ScriptedInput(const Game *g, uint32_t *rng, int32_t tick, GameInput prev) {
+    GameInput in = prev;
+
+    if (tick % 30 == 0) { // Pick a new heading every half a second
+        int32_t x = NextRandom(rng) % 3;
+        int32_t y = NextRandom(rng) % 3;
+        in.left = x == 1;
+        in.right = x == 2;
+        in.up = y == 1;
+        in.down = y == 2;
+    }
 
-                ecs_set_ptr(ecs, laser, Animation, &a_laser);
-                
-                ecs_set(ecs, laser, AIInfo, {NONE});
-            }
+    in.fire = tick % 12 == 0;
 
-            if (IsMouseButtonPressed(MOUSE_BUTTON_RIGHT)) {
-                ecs_entity_t enemy = ecs_new_id(ecs);
+    int32_t spawn_interval = 90 - tick / 60;
+    if (spawn_interval < 10) spawn_interval = 10;
 
-                ecs_set(ecs, enemy, Rotation, {0});
+    in.spawn_enemy = tick % spawn_interval == 0;
+    if (in.spawn_enemy) {
+        float angle = RandomFloat(rng) * 2 * PI;
+        in.spawn_pos = Vector2Add(g->player_pos, Vector2Rotate((Vector2){0, -600}, angle));
+    }
 
-                ecs_set(ecs, enemy, Velocity, {0, 0});
+    return in;
+}
 
-                Position pos = GetScreenToWorld2D(GetMousePosition(), camera);
-                ecs_set_ptr(ecs, enemy, Position, &pos);
+typedef struct BatchResult {
+    uint32_t seed;
+    int32_t ticks;
+    float survival_time;
+    int32_t kills;
+    double tick_ms; // Average simulation cost of a tick
+} BatchResult;
 
-                float scale = 2;
-                ecs_set(ecs, enemy, Scale, {scale});
+typedef struct Batch {
+    const Settings *settings;
+    Sprites sprites;
 
-                ecs_set(ecs, enemy, Health, {3});
+    BatchResult *results;
+    atomic_int next; // Next run to be picked up by a worker
 
-                HitBox hb = CircleHitBox(1, a_enemy.sheet.height * scale);
-                ecs_set_ptr(ecs, enemy, HitBox, &hb);
+    pthread_mutex_t world_lock; // Creating and destroying worlds touches flecs' global state
+} Batch;
 
-                ecs_set(ecs, enemy, Team, {1});
-                ecs_set(ecs, enemy, Flags, {EXPLODE_ON_DEATH | PUSH_ON_COLLISION});
-                ecs_set(ecs, enemy, IFrames, {.init = 16, .cur = 0});
-                
-                ecs_set_ptr(ecs, enemy, AIInfo, &default_homing_ai);
+BatchResult SimulateRun(Batch *b, uint32_t seed) {
+    const float dt = 1. / 60;
 
-                ecs_set_ptr(ecs, enemy, Animation, &a_enemy);
-            }
-        } 
+    Game g;
+    pthread_mutex_lock(&b->world_lock);
+    InitGame(&g, b->sprites, b->settings->tuning, NULL);
+    pthread_mutex_unlock(&b->world_lock);
+
+    ResetGame(&g);
+
+    uint32_t rng = seed ? seed : 1;
+    GameInput in = {0};
+    int32_t tick = 0;
+
+    double start = NowSeconds();
+    for (; tick < b->settings->batch_max_ticks && ecs_is_valid(g.ecs, g.player); tick++) {
+        in = ScriptedInput(&g, &rng, tick, in);
+        StepGame(&g, in, dt);
+    }
+    double elapsed = NowSeconds() - start;
+
+    BatchResult result = {
+        .seed = seed,
+        .ticks = tick,
+        .survival_time = tick * dt,
+        .kills = g.health_params.kills,
+        .tick_ms = tick ? elapsed * 1000 / tick : 0,
+    };
+
+    pthread_mutex_lock(&b->world_lock);
+    FiniGame(&g);
+    pthread_mutex_unlock(&b->world_lock);
+
+    return result;
+}
+
+void *BatchWorker(void *arg) {
+    Batch *b = arg;
+
+    int32_t run;
+    while ((run = atomic_fetch_add(&b->next, 1)) < b->settings->batch_runs) {
+        b->results[run] = SimulateRun(b, b->settings->batch_seed + run);
+    }
+
+    return NULL;
+}
+
+// Plays settings.batch_runs games without a window, one world per thread
+int RunBatch(const Settings *settings) {
+    SetTraceLogLevel(LOG_WARNING);
+
+    Batch b = {
+        .settings = settings,
+        .sprites = DefaultSprites(),
+    };
+
+    if (!LoadSpriteSizes(&b.sprites)) return 1;
+
+    // Before simulating anything, a bad path shouldn't throw the whole sweep away
+    FILE *out = fopen(settings->batch_out, "w");
+    if (!out) {
+        fprintf(stderr, "Couldn't open %s for writing\n", settings->batch_out);
+        return 1;
+    }
+
+    b.results = calloc(settings->batch_runs, sizeof(BatchResult));
+    if (!b.results) {
+        fprintf(stderr, "Couldn't allocate results for %d runs\n", settings->batch_runs);
+        fclose(out);
+        return 1;
+    }
+
+    atomic_init(&b.next, 0);
+    pthread_mutex_init(&b.world_lock, NULL);
+
+    int32_t thread_count = settings->threads < settings->batch_runs ? settings->threads : settings->batch_runs;
+    pthread_t threads[MAX_WORKERS];
+
+    double start = NowSeconds();
+
+    int32_t spawned = 0;
+    for (; spawned < thread_count; spawned++) {
+        if (pthread_create(&threads[spawned], NULL, BatchWorker, &b) != 0) break;
+    }
+    if (spawned == 0) BatchWorker(&b);
+
+    for (int i = 0; i < spawned; i++) {
+        pthread_join(threads[i], NULL);
+    }
+
+    double elapsed = NowSeconds() - start;
+
+    double ticks = 0, survival = 0, kills = 0, tick_ms = 0;
+
+    fprintf(out, "seed,ticks,survival_time,kills,tick_ms\n");
+    for (int i = 0; i < settings->batch_runs; i++) {
+        BatchResult r = b.results[i];
+        fprintf(out, "%u,%d,%.3f,%d,%.4f\n", r.seed, r.ticks, r.survival_time, r.kills, r.tick_ms);
+
+        ticks += r.ticks;
+        survival += r.survival_time;
+        kills += r.kills;
+        tick_ms += r.tick_ms;
+    }
+
+    // Aggregate row, in place of the seed
+    int32_t n = settings->batch_runs;
+    fprintf(out, "mean,%.1f,%.3f,%.2f,%.4f\n", ticks / n, survival / n, kills / n, tick_ms / n);
+
+    bool written = !ferror(out);
+    if (fclose(out) != 0) written = false;
+    if (!written) {
+        fprintf(stderr, "Couldn't write results to %s\n", settings->batch_out);
+    }
+
+    printf("%d runs on %d threads in %.2f s\n", n, spawned ? spawned : 1, elapsed);
+    printf("mean survival time: %.2f s, mean kills: %.2f, mean tick cost: %.4f ms\n",
+            survival / n, kills / n, tick_ms / n);
+    if (written) printf("results written to %s\n", settings->batch_out);
+
+    free(b.results);
+    pthread_mutex_destroy(&b.world_lock);
+    return written ? 0 : 1;
+}
+
+int main(int argc, char **argv) {
+    Settings settings = ParseSettings(argc, argv);
+
+    // Nothing reads the counters in batch mode, and every world would contend on them
+    if (settings.batch_runs > 0) {
+        return RunBatch(&settings);
+    }
+
+    InstallAllocHooks();
+
+    const int screenWidth = 1360;
+    const int screenHeight = 700;
+
+    InitWindow(screenWidth, screenHeight, "starship game");
+    ToggleBorderlessWindowed();
+
+    Scheduler scheduler;
+    StartScheduler(&scheduler, settings.threads);
+
+    Game game;
+    InitGame(&game, DefaultSprites(), settings.tuning, &scheduler);
+    ecs_world_t *ecs = game.ecs;
+
+    Camera2D camera = {
+        .zoom = 1,
+        .offset = {screenWidth / 2., screenHeight / 2.},
+        .target = {0., 0.},
+        .rotation = 0.,
+    };
+
+    Shader sh_immunity = LoadShader(0, ASSET "immunity.fs");
+
+    int sh_im_time = GetShaderLocation(sh_immunity, "time");
+    float timeSec = 0;
+
+    Texture t_bg, t_mg, t_fg;
+    Texture t_heart;
+
+    AssetLoader assets = {0};
+
+    // Sprite sheets are filled in by the asset loader
+    QueueAsset(&assets, ASSET "starship.png", &game.sprites.starship.sheet);
+    QueueAsset(&assets, ASSET "Enemy.png", &game.sprites.enemy.sheet);
+    QueueAsset(&assets, ASSET "laser.png", &game.sprites.laser.sheet);
+    QueueAsset(&assets, ASSET "Explosion.png", &game.sprites.explosion.sheet);
+
+    QueueAsset(&assets, ASSET "Background.png", &t_bg);
+    QueueAsset(&assets, ASSET "Midground.png", &t_mg);
+    QueueAsset(&assets, ASSET "Foreground.png", &t_fg);
+
+    QueueAsset(&assets, ASSET "Heart.png", &t_heart);
+
+    StartAssetLoader(&assets, settings.threads);
+    bool assets_loaded = false;
+
+    GameState gs = MAIN_MENU;
+
+    Profiler profiler = {0};
+
+    WorldTarget world_target = {0};
+
+    FramePacer pacer = MakePacer(60);
+    InputLatch latch = {0};
+
+    Governor governor = MakeGovernor(1. / 60);
+    bool show_debug = false;
+
+    COMPONENTS(ecs);
+    
+    while (!WindowShouldClose()) {
+        LatchInput(&latch); // Polled by the last EndDrawing
+        WaitForInput(&pacer);
+        LatchInput(&latch);
+
+        if (!assets_loaded) {
+            assets_loaded = UploadAssets(&assets);
+            if (assets_loaded) StopAssetLoader(&assets);
+        }
+
+        ProfileFrame(&profiler, &game.frame_arena);
+        profiler.input_latency = pacer.latency;
+        profiler.predicted_work = PredictWork(&pacer);
+        profiler.work = pacer.last_work;
+
+        profiler.quality = governor.level;
+        SetQuality(&game, governor.level);
+
+        int32_t render_scale = settings.render_scale;
+        if (governor.level >= QUALITY_LOW_RES) render_scale *= 2;
+        ResizeWorldTarget(&world_target, render_scale);
+
+        if (latch.toggle_debug) show_debug = !show_debug; // Profiler, hit boxes and health
+
+        BeginDrawing();
+        const float dt = GetFrameTime();
+
+        timeSec += dt;
+        SetShaderValue(sh_immunity, sh_im_time, &timeSec, SHADER_UNIFORM_FLOAT);
+        
+        // ---------------- PROCESSING ----------------
+
+        GameInput input = {
+            .left = IsKeyDown(KEY_LEFT),
+            .right = IsKeyDown(KEY_RIGHT),
+            .up = IsKeyDown(KEY_UP),
+            .down = IsKeyDown(KEY_DOWN),
+            .fire = latch.left_click,
+
+            .spawn_enemy = latch.right_click,
+            .spawn_pos = GetScreenToWorld2D(GetMousePosition(), camera),
+        };
+
+        StepGame(&game, input, dt);
 
         { // Camera 
-            camera.target = Vector2Lerp(camera.target, player_pos, 1 * dt);
+            // Follow where the ship is after this tick's move, not where it was before
+            Position focus = game.player_pos;
+            if (ecs_is_valid(ecs, game.player)) {
+                focus = *ecs_get(ecs, game.player, Position);
+            }
+            camera.target = Vector2Lerp(camera.target, focus, 1 * dt);
 
             if (IsKeyDown(KEY_LEFT_BRACKET)) camera.zoom -= 0.01;
             if (IsKeyDown(KEY_RIGHT_BRACKET)) camera.zoom += 0.01;
             camera.zoom = Clamp(camera.zoom, 0.1, 5);
         }
-        
-        ecs_run(ecs, simAI, dt, &player_pos);
-        ecs_run(ecs, collisions, dt, 0);
-        ecs_run(ecs, move, dt, 0);
-        
-        ecs_run(ecs, removeParticles, dt, 0);
-        ecs_run(ecs, decrementIFrames, dt, 0);
-        ecs_run(ecs, healthCheck, dt, &a_explosion);
 
 
         // ------------ DRAWING ----------------
+
+        Camera2D world_camera = BeginWorld(&world_target, camera);
         
         { // Backgrounds
-            DrawBackground(t_bg, camera, 0.1);
-            DrawBackground(t_mg, camera, 0.4);
-            DrawBackground(t_fg, camera, 0.9);
+            Vector2 view = WorldViewSize(&world_target);
+            DrawBackground(t_bg, world_camera, view, 0.1);
+            DrawBackground(t_mg, world_camera, view, 0.4);
+            DrawBackground(t_fg, world_camera, view, 0.9);
         }
 
-        // ecs_run(ecs, drawHB, dt, 0);
-        ecs_run(ecs, draw, dt, 0);
-        ecs_run(ecs, drawIFrames, dt, &sh_immunity);
+        ecs_run(ecs, game.draw, dt, 0);
+        ecs_run(ecs, game.drawIFrames, dt, &sh_immunity);
 
-        EndMode2D();
+        if (show_debug && governor.level < QUALITY_NO_OVERLAYS) {
+            ecs_run(ecs, game.drawHB, dt, 0);
+            ecs_run(ecs, game.drawHealth, dt, 0);
+        }
+
+        EndWorld(&world_target);
 
         // UI    
         {
             DrawFPS(GetScreenWidth() - 100, 5);
+            if (show_debug) DrawProfiler(profiler, GetScreenWidth() - 220, 30);
 
             Button b_default = {
                 .text = "DEFAULT, YOU SHOULD SET THIS YOURSELF",
@@ -884,8 +2954,8 @@ int main(void) {
                 case GAME: {
                    static Health player_hp = 0; 
 
-                   if (ecs_is_valid(ecs, player)) {
-                       player_hp = *ecs_get(ecs, player, Health);
+                   if (ecs_is_valid(ecs, game.player)) {
+                       player_hp = *ecs_get(ecs, game.player, Health);
                    } else { 
                         gs = DEATH_SCREEN;
                    }
@@ -898,24 +2968,15 @@ int main(void) {
                 case MAIN_MENU: {
                     Button b_play = b_default;
                     b_play.text = "PLAY";
-                    if (ShowButton(b_play)) {
-                        { // Delete every entity (that has a flags component)
-                            ecs_query_t *q = ecs_query(ecs, {
-                                        .filter.terms = {
-                                            {ecs_id(Flags)}
-                                        }
-                                    });
-
-                            ecs_iter_t it = ecs_query_iter(ecs, q);
-
-                            while (ecs_query_next(&it)) {
-                                for (int i = 0; i < it.count; ++i) {
-                                    ecs_delete(ecs, it.entities[i]);
-                                }
-                            }
-                        }
-
-                        player = MakePlayer(ecs, (PlayerInfo){.anim = a_starship});
+
+                    if (!assets_loaded || assets.failed > 0) { // Can't spawn anything without its sprites
+                        b_play.text = assets_loaded
+                            ? TextFormat("%d ASSETS MISSING", assets.failed)
+                            : TextFormat("LOADING %d/%d", assets.uploaded, assets.count);
+                        b_play.hcolor = b_play.color;
+                        ShowButton(b_play, latch.left_click);
+                    } else if (ShowButton(b_play, latch.left_click)) {
+                        ResetGame(&game);
                         
                         gs = GAME;
                     }
@@ -929,43 +2990,35 @@ int main(void) {
                     b_main_menu.text = "MAIN MENU";
                     b_main_menu.pos.y = 600;
 
-                    if (ShowButton(b_restart)) {
+                    if (ShowButton(b_restart, latch.left_click)) {
                         gs = GAME;
                         
-                        { // Delete every entity (that has a flags component)
-                            ecs_query_t *q = ecs_query(ecs, {
-                                        .filter.terms = {
-                                            {ecs_id(Flags)}
-                                        }
-                                    });
-
-                            ecs_iter_t it = ecs_query_iter(ecs, q);
-
-                            while (ecs_query_next(&it)) {
-                                for (int i = 0; i < it.count; ++i) {
-                                    ecs_delete(ecs, it.entities[i]);
-                                }
-                            }
-                        }
-
-                        player = MakePlayer(ecs, (PlayerInfo){ .anim = a_starship });
-                        camera.target = *ecs_get(ecs, player, Position);
+                        ResetGame(&game);
+                        camera.target = *ecs_get(ecs, game.player, Position);
                     }
                     
-                    if (ShowButton(b_main_menu)) {
+                    if (ShowButton(b_main_menu, latch.left_click)) {
                         gs = MAIN_MENU;
                     }
                 } break;
             }
         }
 
+        FrameBuilt(&pacer);
         EndDrawing();
+        FramePresented(&pacer);
+        UpdateGovernor(&governor, pacer.last_work, pacer.last_present, show_debug ? 0 : 1u << QUALITY_NO_OVERLAYS);
+
+        latch = (InputLatch){0};
     }
 
+    StopAssetLoader(&assets);
     UnloadShader(sh_immunity);
+    ResizeWorldTarget(&world_target, 1); // Frees the render texture
 
     CloseWindow(); // Close window and OpenGL context
-    ecs_fini(ecs);
+    FiniGame(&game);
+    StopScheduler(&scheduler);
 
     return 0;
 }